@@ -26,94 +26,369 @@
 #include <algorithm>
 #include <cassert>
 
+#include <sys/stat.h>
+
 #include "book.h"
 #include "misc.h"
 
 using namespace std;
 
-PolyglotBook::~PolyglotBook() { if (is_open()) close(); }
-
+namespace {
 
-/// operator>>() reads sizeof(T) chars from the file's binary byte stream and
-/// converts them into a number of type T. A Polyglot book stores numbers in
-/// big-endian format.
+/// read() converts sizeof(T) bytes in big-endian format, as a Polyglot book
+/// stores numbers, into a number of type T.
 
-template<typename T> PolyglotBook& PolyglotBook::operator>>(T& n) {
+template<typename T> T read(const uint8_t* data) {
 
-  n = 0;
+  T n = 0;
   for (size_t i = 0; i < sizeof(T); ++i)
-      n = T((n << 8) + ifstream::get());
+      n = T((n << 8) + data[i]);
+
+  return n;
+}
+
+/// lower_bound() does a binary search through an array of records, sorted by
+/// a leading key, and returns the index of the leftmost record with the given
+/// key, or of the record after if there is none.
+
+size_t lower_bound(const uint8_t* data, size_t size, size_t stride, Key key, bool* found) {
+
+  size_t low = 0, mid, high = size - 1;
+
+  assert(low <= high);
+
+  while (low < high)
+  {
+      mid = (low + high) / 2;
+
+      assert(mid >= low && mid < high);
+
+      if (key <= read<uint64_t>(data + mid * stride))
+          high = mid;
+      else
+          low = mid + 1;
+  }
+
+  assert(low == high);
+
+  *found = key == read<uint64_t>(data + low * stride);
+  return low;
+}
+
+/// lower_bound() for many sorted keys runs their binary searches in lockstep, a
+/// group at a time. At each step the records that all the searches of the group
+/// are going to read are prefetched before comparing the first one, so that the
+/// cache misses overlap instead of stalling each search in turn. A group of few
+/// searches, that keeps the memory mostly idle, prefetches also the two records
+/// each search can read at the next step. With more searches the misses already
+/// overlap and the records never read would only take memory bandwidth.
+///
+/// As keys are sorted, a key goes right wherever the last key of the previous
+/// group went right, until it leaves its path, and those records are not read
+/// again.
+
+void lower_bound(const uint8_t* data, size_t size, size_t stride, const Key* keys,
+                 size_t n, size_t* idx, bool* found) {
+
+  const size_t GroupSize = 16;
+  const size_t AheadSize = 4; // Smaller groups prefetch the next step too
+
+  size_t half[64], steps = 0;
+  uint64_t lastRight = 0; // Steps where the last search of the group went right
+  bool onPath[GroupSize];
+
+  assert(size > 0);
 
-  return *this;
+  // The halves of the range at each step do not depend on the comparisons
+  for (size_t len = size; len > 1; len -= len / 2)
+      half[steps++] = len / 2;
+
+  for (size_t g = 0; g < n; g += GroupSize)
+  {
+      size_t cnt = min(GroupSize, n - g);
+      size_t* base = idx + g;
+      uint64_t right = 0;
+      bool ahead = cnt < AheadSize;
+
+      fill(base, base + cnt, 0);
+      fill(onPath, onPath + cnt, g > 0);
+
+      for (size_t s = 0; s < steps; ++s)
+      {
+          for (size_t i = 0; i < cnt; ++i)
+          {
+              uint8_t* p = const_cast<uint8_t*>(data + base[i] * stride);
+
+              if (!ahead || !s)
+                  prefetch(p + half[s] * stride);
+
+              if (ahead && s + 1 < steps)
+              {
+                  prefetch(p + half[s + 1] * stride);
+                  prefetch(p + (half[s] + half[s + 1]) * stride);
+              }
+          }
+
+          size_t last = base[cnt - 1];
+
+          for (size_t i = 0; i < cnt; ++i)
+          {
+              bool known = onPath[i] && (lastRight >> s) & 1;
+              bool goRight = known || read<uint64_t>(data + (base[i] + half[s]) * stride) < keys[g + i];
+
+              base[i] += goRight ? half[s] : 0;
+              onPath[i] = onPath[i] && (known || !goRight);
+          }
+
+          right |= uint64_t(base[cnt - 1] != last) << s;
+      }
+
+      lastRight = right;
+
+      for (size_t i = 0; i < cnt; ++i)
+      {
+          if (base[i] + 1 < size && read<uint64_t>(data + base[i] * stride) < keys[g + i])
+              ++base[i];
+
+          found[g + i] = keys[g + i] == read<uint64_t>(data + base[i] * stride);
+      }
+  }
 }
 
-template<> PolyglotBook& PolyglotBook::operator>>(PolyEntry& e) {
-  return *this >> e.key >> e.move >> e.weight >> e.learn;
+} // namespace
+
+
+/// operator[]() decodes the book entry at the given index
+
+PolyEntry PolyglotBook::operator[](size_t idx) const {
+
+  assert(idx < entries);
+
+  const uint8_t* p = data + idx * SizeOfPolyEntry;
+  PolyEntry e;
+  e.key    = read<uint64_t>(p);
+  e.move   = read<uint16_t>(p + 8);
+  e.weight = read<uint16_t>(p + 10);
+  e.learn  = read<uint32_t>(p + 12);
+  return e;
 }
 
 
-/// open() tries to open a book file with the given name after closing any
-/// existing one.
+/// summary() decodes the summary record at the given index
+
+SumEntry PolyglotBook::summary(size_t idx) const {
 
-bool PolyglotBook::open(const char* fName) {
+  assert(idx < sumEntries);
 
-  if (is_open()) // Cannot close an already closed file
-      close();
+  const uint8_t* p = sumData + SizeOfSumHeader + idx * SizeOfSumEntry;
+  SumEntry s;
+  s.key    = read<uint64_t>(p);
+  s.move   = read<uint16_t>(p + 8);
+  s.weight = read<uint16_t>(p + 10);
 
-  ifstream::open(fName, ifstream::in | ifstream::binary);
+  for (int i = 0; i < 4; ++i)
+      s.results[i] = read<uint32_t>(p + 12 + 4 * i);
 
-  fileName = is_open() ? fName : "";
-  ifstream::clear(); // Reset any error flag to allow a retry ifstream::open()
-  return !fileName.empty();
+  s.first  = read<uint64_t>(p + 28);
+  return s;
 }
 
 
-/// probe() tries to find a book move for the given position
+/// game() returns the game of a book entry, given its 'learn' field. Books
+/// without a game table store the offset of the game divided by 8 instead of
+/// the game id, pointing somewhere inside the game, and length is unknown.
 
-size_t PolyglotBook::probe(Key key, const string& fName, bool* found) {
+GameEntry PolyglotBook::game(uint32_t learn) const {
 
-  if (fileName != fName && !open(fName.c_str()))
-      return 0;
+  if (!gameData)
+      return { uint64_t(learn & 0x3FFFFFFF) << 3, 0, 0 };
+
+  uint64_t id = learn & GameIdMask;
+
+  if (id >= gameEntries)
+      return { id << 3, 0, 0 };
+
+  const uint8_t* p = gameData + SizeOfGameHeader + id * SizeOfGameEntry;
+  return { read<uint64_t>(p), read<uint32_t>(p + 8), read<uint32_t>(p + 12) };
+}
+
+
+/// up_to_date() returns true if a book is mapped and its file has not been
+/// replaced or rewritten on disk since then.
+
+bool PolyglotBook::up_to_date() const {
+
+  struct stat st;
+
+  return   !fileName.empty()
+        && !stat(fileName.c_str(), &st)
+        && fileSize == uint64_t(st.st_size)
+        && fileTime == uint64_t(st.st_mtime)
+        && fileId == uint64_t(st.st_ino);
+}
+
+
+/// open() maps the book file with the given name, unless it is already mapped
+/// and has not changed on disk since then.
+
+bool PolyglotBook::open(const string& fName) {
+
+  struct stat st;
+
+  if (fileName == fName && up_to_date())
+      return true;
 
-  size_t ofs = find_first(key, found);
   close();
-  return ofs;
+
+  if (stat(fName.c_str(), &st))
+      return false;
+
+  void* baseAddress;
+  uint64_t size;
+
+  if (!map_file(fName.c_str(), &baseAddress, &mapping, &size))
+      return false;
+
+  data = (uint8_t*)baseAddress;
+  entries = size / SizeOfPolyEntry;
+  fileSize = uint64_t(st.st_size);
+  fileTime = uint64_t(st.st_mtime);
+  fileId = uint64_t(st.st_ino);
+  fileName = fName;
+  sumData = open_sidecar(fName + ".sum", SumMagic, SizeOfSumHeader, SizeOfSumEntry,
+                         &sumMapping, &sumEntries);
+  gameData = open_sidecar(fName + ".games", GameMagic, SizeOfGameHeader, SizeOfGameEntry,
+                          &gameMapping, &gameEntries, &gameSize);
+
+  // The list of the PGN files follows the games: size indexed, name length
+  // and name of each file.
+  if (gameData && read<uint64_t>(gameData + 8) <= gameEntries)
+  {
+      gameEntries = read<uint64_t>(gameData + 8);
+
+      const uint8_t* p = gameData + SizeOfGameHeader + gameEntries * SizeOfGameEntry;
+      const uint8_t* end = gameData + gameSize;
+
+      for (uint64_t n = read<uint64_t>(gameData + 16); n && p + 12 <= end; --n)
+      {
+          size_t len = std::min(size_t(read<uint32_t>(p + 8)), size_t(end - p - 12));
+          pgnFiles.push_back(string((const char*)p + 12, len));
+          p += 12 + len;
+      }
+  }
+  return true;
 }
 
 
-/// find_first() takes a book key as input, and does a binary search through
-/// the book file for the given key. Returns the index of the leftmost book
-/// entry with the same key as the input.
+/// open_sidecar() maps a file written together with the book, like the summary
+/// or the game table. The header starts with the magic and ends with the number
+/// of book entries, that is checked to detect a file left by a different book.
+/// The records follow, their count is out of the file size and it can include
+/// a trailer. Returns nullptr if the file is missing or does not match.
 
-size_t PolyglotBook::find_first(Key key, bool* found) {
+uint8_t* PolyglotBook::open_sidecar(const string& fName, uint64_t magic, size_t headerSize,
+                                    size_t entrySize, uint64_t* fileMapping, uint64_t* cnt,
+                                    uint64_t* mappedSize) {
 
-  seekg(0, ios::end); // Move pointer to end, so tellg() gets file's size
+  void* baseAddress;
+  uint64_t size;
 
-  size_t ofs, low = 0, mid, high = (size_t)tellg() / SizeOfPolyEntry - 1;
-  PolyEntry e = PolyEntry();
+  *cnt = 0;
 
-  assert(low <= high);
+  if (!map_file(fName.c_str(), &baseAddress, fileMapping, &size))
+      return nullptr;
 
-  while (low < high && good())
+  const uint8_t* p = (const uint8_t*)baseAddress;
+
+  if (   size < headerSize
+      || read<uint64_t>(p) != magic
+      || read<uint64_t>(p + headerSize - 8) != entries)
   {
-      mid = (low + high) / 2;
+      unmap_file(baseAddress, *fileMapping);
+      *fileMapping = 0;
+      return nullptr;
+  }
 
-      assert(mid >= low && mid < high);
+  *cnt = (size - headerSize) / entrySize;
 
-      seekg(mid * SizeOfPolyEntry, ios_base::beg);
-      *this >> e;
+  if (mappedSize)
+      *mappedSize = size;
 
-      if (key <= e.key)
-          high = mid;
-      else
-          low = mid + 1;
+  return (uint8_t*)baseAddress;
+}
+
+
+/// close() unmaps the book, if any. It must be called before the book file is
+/// rewritten in place.
+
+void PolyglotBook::close() {
+
+  unmap_file(data, mapping);
+  unmap_file(sumData, sumMapping);
+  unmap_file(gameData, gameMapping);
+  data = sumData = gameData = nullptr;
+  mapping = entries = sumMapping = sumEntries = gameMapping = gameEntries = gameSize = 0;
+  fileName.clear();
+  pgnFiles.clear();
+}
+
+
+/// probe() searches the book already open for the given key. Returns the index
+/// of the first entry with the key. It does not change the book, so many
+/// threads can probe it at once.
+
+size_t PolyglotBook::probe(Key key, bool* found) const {
+
+  *found = false;
+
+  if (!entries)
+      return 0;
+
+  return lower_bound(data, entries, SizeOfPolyEntry, key, found);
+}
+
+
+/// probe_summary() returns the index of the first summary record with the given
+/// key. The book must be already open.
+
+size_t PolyglotBook::probe_summary(Key key, bool* found) const {
+
+  *found = false;
+
+  if (!sumEntries)
+      return 0;
+
+  return lower_bound(sumData + SizeOfSumHeader, sumEntries, SizeOfSumEntry, key, found);
+}
+
+
+/// probe() with many keys, sorted, stores the index of the first entry of each
+/// one in 'idx' and whether it was found in 'found', as probe() does for one.
+
+void PolyglotBook::probe(const Key* keys, size_t n, size_t* idx, bool* found) const {
+
+  if (!entries)
+  {
+      fill(idx, idx + n, 0);
+      fill(found, found + n, false);
+      return;
   }
 
-  assert(low == high);
+  lower_bound(data, entries, SizeOfPolyEntry, keys, n, idx, found);
+}
+
+
+/// probe_summary() with many keys, sorted, is probe() with many keys for the
+/// summary records.
+
+void PolyglotBook::probe_summary(const Key* keys, size_t n, size_t* idx, bool* found) const {
+
+  if (!sumEntries)
+  {
+      fill(idx, idx + n, 0);
+      fill(found, found + n, false);
+      return;
+  }
 
-  ofs = low * SizeOfPolyEntry;
-  seekg(ofs, std::ios_base::beg);
-  *this >> e;
-  *found = key == e.key;
-  return ofs;
+  lower_bound(sumData + SizeOfSumHeader, sumEntries, SizeOfSumEntry, keys, n, idx, found);
 }
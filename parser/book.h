@@ -20,24 +20,99 @@
 #ifndef BOOK_H_INCLUDED
 #define BOOK_H_INCLUDED
 
-#include <fstream>
 #include <string>
+#include <vector>
 
 #include "misc.h"
 #include "position.h"
 
-class PolyglotBook : private std::ifstream {
+/// SumEntry is a record of the optional summary file written next to the book.
+/// There is one record per (key, move), in book order, with the results of the
+/// games and the index of the first book entry of the move. Numbers are stored
+/// in big-endian format after a header with a magic and the number of book
+/// entries, that is checked to detect a summary of a different book.
+
+struct SumEntry {
+  Key key;
+  PMove move;
+  uint16_t weight;
+  uint32_t results[4];
+  uint64_t first;
+};
+
+const size_t SizeOfSumEntry = 8 + 2 + 2 + 4 * 4 + 8;
+const size_t SizeOfSumHeader = 16;
+const uint64_t SumMagic = 0x43444253554D0001ULL; // "CDBSUM" and version
+
+/// GameEntry is a record of the game table written next to the book. Book
+/// entries store the game id, that is the index of the game in the table, in
+/// the lower 29 bits of 'learn', and the table maps it to the PGN file of the
+/// game, as an index in the list of the files of the book, and to the exact
+/// offset and length of the game in the file. Bit 29 flags the moves read from
+/// the variations of the game. Numbers are stored in big-endian format after a
+/// header with a magic, the number of games, the number of files, the build
+/// flags and the number of book entries. The list of the files follows the
+/// games, each one with the size indexed so far and the name, so that a book
+/// can be updated with the games appended since then, or with new files.
+
+struct GameEntry {
+  uint64_t ofs;
+  uint32_t len;
+  uint32_t file;
+};
+
+const size_t SizeOfGameEntry = 8 + 4 + 4;
+const uint32_t VariationFlag = 1 << 29;
+const uint32_t GameIdMask = VariationFlag - 1;
+const size_t SizeOfGameHeader = 40;
+const uint64_t GameMagic = 0x43444247414D0003ULL; // "CDBGAM" and version
+
+enum BuildFlags : uint64_t {
+  BUILD_FULL = 1, BUILD_STRICT = 2, BUILD_VARIATIONS = 4
+};
+
+/// PolyglotBook maps a book file, and its summary and game table if any, in
+/// memory and decodes the big-endian entries on access. The mapping is kept
+/// across probes of the same file, and is refreshed when the file on disk is
+/// replaced or rewritten.
+
+class PolyglotBook {
 public:
- ~PolyglotBook();
-  size_t probe(Key key, const std::string& fName, bool* found);
+  PolyglotBook() = default;
+  PolyglotBook(const PolyglotBook&) = delete;
+  PolyglotBook& operator=(const PolyglotBook&) = delete;
+ ~PolyglotBook() { close(); }
 
-private:
-  template<typename T> PolyglotBook& operator>>(T& n);
+  bool open(const std::string& fName);
+  bool up_to_date() const;
+  void close();
+  size_t probe(Key key, bool* found) const;
+  size_t probe_summary(Key key, bool* found) const;
+  void probe(const Key* keys, size_t n, size_t* idx, bool* found) const;
+  void probe_summary(const Key* keys, size_t n, size_t* idx, bool* found) const;
+  size_t size() const { return entries; }
+  size_t summary_size() const { return sumEntries; }
+  bool has_summary() const { return sumData != nullptr; }
+  bool has_games() const { return gameData != nullptr; }
+  PolyEntry operator[](size_t idx) const;
+  SumEntry summary(size_t idx) const;
+  GameEntry game(uint32_t learn) const;
+  const std::vector<std::string>& pgn_files() const { return pgnFiles; }
 
-  bool open(const char* fName);
-  size_t find_first(Key key, bool* found);
+private:
+  uint8_t* open_sidecar(const std::string& fName, uint64_t magic, size_t headerSize,
+                        size_t entrySize, uint64_t* fileMapping, uint64_t* cnt,
+                        uint64_t* mappedSize = nullptr);
 
+  uint8_t* data = nullptr;
+  uint8_t* sumData = nullptr;
+  uint8_t* gameData = nullptr;
+  uint64_t mapping = 0, entries = 0;
+  uint64_t sumMapping = 0, sumEntries = 0;
+  uint64_t gameMapping = 0, gameEntries = 0, gameSize = 0;
+  uint64_t fileSize = 0, fileTime = 0, fileId = 0;
   std::string fileName;
+  std::vector<std::string> pgnFiles;
 };
 
 #endif // #ifndef BOOK_H_INCLUDED
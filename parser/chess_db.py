@@ -40,13 +40,16 @@ class Parser:
         self.pgn = ''
         self.db = ''
 
-    def make(self, full=True):
-        '''Make an index out of a pgn file'''
+    def make(self, full=True, summary=False):
+        '''Make an index out of a pgn file, with a summary to speed up find
+           on positions with many games'''
         if not self.pgn:
             raise NameError("Unknown DB, first open a PGN file")
         cmd = 'book ' + self.pgn
         if full:
             cmd += ' full'
+        if summary:
+            cmd += ' summary'
         self.p.sendline(cmd)
         self.wait_ready()
         s = '{' + self.p.before.split('{')[1]
@@ -57,22 +60,46 @@ class Parser:
 
     def find(self, fen, limit=10, skip=0):
         '''Find all games with positions equal to fen'''
+        return self.find_many([fen], limit, skip)[0]
+
+    def find_many(self, fens, limit=10, skip=0):
+        '''Find the games of many positions at once. All the requests are sent
+           tagged with their index, without waiting for the responses, that
+           are then matched by id and returned in the order of fens'''
         if not self.db:
             raise NameError("Unknown DB, first open a PGN file")
-        cmd = "find {} limit {} skip {} {}".format(self.db, limit, skip, fen)
-        self.p.sendline(cmd)
+        for i, fen in enumerate(fens):
+            cmd = "find {} id {} limit {} skip {} {}".format(self.db, i, limit, skip, fen)
+            self.p.sendline(cmd)
         self.wait_ready()
-        result = json.loads(self.p.before)
+        results = [None] * len(fens)
+        for line in self.p.before.splitlines():
+            if line.startswith('{'):
+                result = json.loads(line)
+                results[int(result.pop('id'))] = result
         self.p.before = ''
-        return result
+        return results
 
-    def get_games(self, list):
-        '''Retrieve the PGN games specified in the offset list'''
+    def get_games(self, list, lengths=None, files=None):
+        '''Retrieve the PGN games specified in the offset list. When also the
+           'pgn lengths' list returned by find is given, games are read
+           directly instead of scanning the file for their boundaries. With
+           a book of many PGN files the 'pgn files' list gives the file of
+           each game'''
         if not self.pgn:
             raise NameError("Unknown DB, first open a PGN file")
+        if not files:
+            files = [self.pgn] * len(list)
         pgn = []
-        with open(self.pgn, "r") as f:
-            for ofs in list:
+        if lengths:
+            for ofs, length, name in zip(list, lengths, files):
+                with open(name, "rb") as f:
+                    f.seek(ofs)
+                    game = f.read(length).decode('utf-8', 'replace')
+                    pgn.append(game.replace('\r\n', '\n').strip())
+            return pgn
+        for ofs, name in zip(list, files):
+            with open(name, "r") as f:
                 f.seek(ofs)
                 game = ''
                 for line in f:
@@ -0,0 +1,261 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <mutex>
+
+#include "bitboard.h"
+#include "book.h"
+#include "chessdb.h"
+#include "parser.h"
+#include "position.h"
+#include "uci.h"
+
+struct chessdb_book {
+    PolyglotBook book;
+};
+
+struct chessdb_moves {
+    std::vector<chessdb_move> moves;
+    std::vector<chessdb_game> games;
+};
+
+namespace {
+
+std::once_flag InitFlag;
+std::mutex BuildMutex; // Builds share the tables of the parser, one at a time
+thread_local std::string LastError;
+
+/// init() sets up the tables of the parser at the first call of the library
+void init() {
+
+    std::call_once(InitFlag, []() {
+        Bitboards::init();
+        Position::init();
+        Parser::init();
+    });
+}
+
+int fail(const std::string& error) {
+
+    LastError = error;
+    return -1;
+}
+
+/// build() builds a book with the options of the C interface
+int build(BuildOptions& opts, const char* book_file, const chessdb_options* options,
+          chessdb_progress progress, void* ctx, chessdb_stats* stats) {
+
+    init();
+
+    if (book_file)
+        opts.bookName = book_file;
+
+    if (options)
+    {
+        opts.full = options->full;
+        opts.summary = options->summary;
+        opts.strict = options->strict;
+        opts.variations = options->variations;
+        opts.update = options->update;
+        opts.threads = options->threads ? options->threads : opts.threads;
+        opts.memory = options->memory_mb;
+        opts.cache = options->cache_mb ? options->cache_mb : opts.cache;
+    }
+
+    if (progress)
+        opts.progress = [=](uint64_t done, uint64_t total) { progress(ctx, done, total); };
+
+    opts.quiet = true;
+
+    std::lock_guard<std::mutex> lk(BuildMutex);
+
+    BuildResult res = Parser::build_book(opts);
+
+    if (!res.error.empty())
+        return fail(res.error);
+
+    if (stats)
+    {
+        stats->games = res.stats.games;
+        stats->moves = res.stats.moves;
+        stats->variations = res.stats.variations;
+        stats->fixed = res.stats.fixed;
+        stats->rejected = res.stats.rejected;
+        stats->book_size = res.bookSize;
+    }
+    return 0;
+}
+
+} // namespace
+
+extern "C" {
+
+int chessdb_api_version() {
+    return CHESSDB_API_VERSION;
+}
+
+const char* chessdb_last_error() {
+    return LastError.c_str();
+}
+
+/// chessdb_open() maps a book, and its summary and game table if any. Returns
+/// NULL if the book can not be opened.
+
+chessdb_book* chessdb_open(const char* book_file) {
+
+    init();
+
+    chessdb_book* b = new chessdb_book;
+
+    if (!b->book.open(book_file))
+    {
+        delete b;
+        fail(std::string("Could not open ") + book_file);
+        return nullptr;
+    }
+    return b;
+}
+
+void chessdb_close(chessdb_book* book) {
+    delete book;
+}
+
+size_t chessdb_num_pgn_files(const chessdb_book* book) {
+    return book->book.pgn_files().size();
+}
+
+const char* chessdb_pgn_file(const chessdb_book* book, size_t idx) {
+
+    const std::vector<std::string>& files = book->book.pgn_files();
+    return idx < files.size() ? files[idx].c_str() : nullptr;
+}
+
+/// chessdb_key() computes the key of the position in a FEN string, the one the
+/// book is sorted by.
+
+int chessdb_key(const char* fen, uint64_t* key) {
+
+    init();
+
+    if (!Parser::valid_fen(fen))
+        return fail(std::string("Invalid FEN string ") + fen);
+
+    StateInfo st;
+    Position pos;
+    pos.set(fen, false, &st);
+    *key = pos.key();
+    return 0;
+}
+
+/// chessdb_probe_key() returns the moves of the position with the given key,
+/// with the window of their games made of 'limit' games after the first 'skip'
+/// ones, 'limit' between 1 and 3000 as for the 'find' command. The moves are
+/// empty if the position is not found, and must be released with
+/// chessdb_free_moves(). Returns NULL if 'limit' is out of range.
+
+chessdb_moves* chessdb_probe_key(const chessdb_book* book, uint64_t key, size_t limit, size_t skip) {
+
+    if (limit > 3000 || limit < 1)
+    {
+        LastError = "limit must be between 1 and 3000";
+        return nullptr;
+    }
+
+    std::vector<BookMove> found = Parser::probe(book->book, key, limit, skip);
+    chessdb_moves* moves = new chessdb_moves;
+    size_t cnt = 0;
+
+    for (const BookMove& m : found)
+        cnt += m.games.size();
+
+    moves->moves.reserve(found.size());
+    moves->games.reserve(cnt); // Moves point into it, it can not grow further
+
+    for (const BookMove& m : found)
+    {
+        chessdb_move cm = {};
+        const uint64_t* r = m.results;
+
+        std::strncpy(cm.move, UCI::move(Move(m.move), false).c_str(), sizeof(cm.move) - 1);
+        cm.weight = m.weight;
+        cm.games = r[0] + r[1] + r[2] + r[3];
+        cm.wins = r[0];
+        cm.losses = r[1];
+        cm.draws = r[2];
+        cm.num_games = m.games.size();
+        cm.game = moves->games.data() + moves->games.size();
+
+        for (const GameEntry& g : m.games)
+            moves->games.push_back({ g.ofs, g.len, g.file });
+
+        moves->moves.push_back(cm);
+    }
+    return moves;
+}
+
+/// chessdb_probe_fen() is chessdb_probe_key() for the position of a FEN string.
+/// Returns NULL also if the FEN string is not valid.
+
+chessdb_moves* chessdb_probe_fen(const chessdb_book* book, const char* fen, size_t limit, size_t skip) {
+
+    uint64_t key;
+    return chessdb_key(fen, &key) ? nullptr : chessdb_probe_key(book, key, limit, skip);
+}
+
+size_t chessdb_num_moves(const chessdb_moves* moves) {
+    return moves->moves.size();
+}
+
+const chessdb_move* chessdb_move_at(const chessdb_moves* moves, size_t idx) {
+    return idx < moves->moves.size() ? &moves->moves[idx] : nullptr;
+}
+
+void chessdb_free_moves(chessdb_moves* moves) {
+    delete moves;
+}
+
+/// chessdb_build_files() builds a book out of PGN files, as the 'book' command
+/// does, or updates it with 'update' in the options. Options can be NULL for
+/// the defaults, and the book file too, to name it after the first PGN file.
+
+int chessdb_build_files(const char* const* pgn_files, size_t count, const char* book_file,
+                        const chessdb_options* options, chessdb_progress progress, void* ctx,
+                        chessdb_stats* stats) {
+
+    BuildOptions opts;
+    opts.pgnNames.assign(pgn_files, pgn_files + count);
+    return build(opts, book_file, options, progress, ctx, stats);
+}
+
+/// chessdb_build_buffer() builds a book out of a PGN in memory. The offsets of
+/// the games are the ones in the buffer. A book in memory can not be updated.
+
+int chessdb_build_buffer(const char* data, size_t size, const char* book_file,
+                         const chessdb_options* options, chessdb_progress progress, void* ctx,
+                         chessdb_stats* stats) {
+
+    BuildOptions opts;
+    opts.data = data;
+    opts.size = size;
+    return build(opts, book_file, options, progress, ctx, stats);
+}
+
+} // extern "C"
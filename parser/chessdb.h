@@ -0,0 +1,97 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* C interface of libchessdb, to build and probe books in process. Functions
+   returning an int return zero on success and -1 on failure, with the reason
+   given by chessdb_last_error(), like a malformed PGN: the library never ends
+   the process nor writes to stderr. Books can be probed by many threads at
+   once, builds run one at a time. Build with 'make lib ARCH=<arch>'. */
+
+#ifndef CHESSDB_H_INCLUDED
+#define CHESSDB_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHESSDB_API_VERSION 1
+
+typedef struct chessdb_book chessdb_book;   /* An open book */
+typedef struct chessdb_moves chessdb_moves; /* The moves of a probe */
+
+typedef struct {
+    uint64_t offset;  /* Of the game in its PGN file */
+    uint32_t length;  /* Zero if unknown, for books without a game table */
+    uint32_t file;    /* Index of the PGN file, see chessdb_pgn_file() */
+} chessdb_game;
+
+typedef struct {
+    char move[6];     /* Coordinate notation, like "e2e4" or "a7a8q" */
+    uint16_t weight;
+    uint64_t games, wins, losses, draws;
+    size_t num_games; /* Games in the window requested */
+    const chessdb_game* game;
+} chessdb_move;
+
+typedef struct {
+    int full, summary, strict, variations, update;
+    size_t threads, memory_mb, cache_mb; /* Zero for the defaults */
+} chessdb_options;
+
+typedef struct {
+    int64_t games, moves, variations, fixed, rejected;
+    uint64_t book_size;
+} chessdb_stats;
+
+/* Called with the bytes parsed so far and the bytes to parse, zero if unknown */
+typedef void (*chessdb_progress)(void* ctx, uint64_t done, uint64_t total);
+
+int chessdb_api_version(void);
+const char* chessdb_last_error(void);
+
+chessdb_book* chessdb_open(const char* book_file);
+void chessdb_close(chessdb_book* book);
+size_t chessdb_num_pgn_files(const chessdb_book* book);
+const char* chessdb_pgn_file(const chessdb_book* book, size_t idx);
+
+int chessdb_key(const char* fen, uint64_t* key);
+
+/* Probes return NULL on a 'limit' out of 1..3000, or an invalid FEN */
+chessdb_moves* chessdb_probe_key(const chessdb_book* book, uint64_t key, size_t limit, size_t skip);
+chessdb_moves* chessdb_probe_fen(const chessdb_book* book, const char* fen, size_t limit, size_t skip);
+size_t chessdb_num_moves(const chessdb_moves* moves);
+const chessdb_move* chessdb_move_at(const chessdb_moves* moves, size_t idx);
+void chessdb_free_moves(chessdb_moves* moves);
+
+int chessdb_build_files(const char* const* pgn_files, size_t count, const char* book_file,
+                        const chessdb_options* options, chessdb_progress progress, void* ctx,
+                        chessdb_stats* stats);
+int chessdb_build_buffer(const char* data, size_t size, const char* book_file,
+                         const chessdb_options* options, chessdb_progress progress, void* ctx,
+                         chessdb_stats* stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // #ifndef CHESSDB_H_INCLUDED
@@ -18,8 +18,34 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
 #include <iostream>
 
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#if !defined(NO_PREFETCH) && (defined(__INTEL_COMPILER) || defined(_MSC_VER))
+#  include <xmmintrin.h> // Intel and Microsoft header for _mm_prefetch()
+#endif
+
 #include "misc.h"
 
 using namespace std;
@@ -41,3 +67,349 @@ void dbg_print() {
       cerr << "Total " << means[0] << " Mean "
            << (double)means[1] / means[0] << endl;
 }
+
+
+/// prefetch() preloads the given address in L1/L2 cache. This is a non-blocking
+/// function that doesn't stall the CPU waiting for data to be loaded from memory,
+/// which can be quite slow.
+#ifdef NO_PREFETCH
+
+void prefetch(void*) {}
+
+#else
+
+void prefetch(void* addr) {
+
+#  if defined(__INTEL_COMPILER)
+   // This hack prevents prefetches from being optimized away by
+   // Intel compiler. Both MSVC and gcc seem not be affected by this.
+   __asm__ ("");
+#  endif
+
+#  if defined(__INTEL_COMPILER) || defined(_MSC_VER)
+  _mm_prefetch((char*)addr, _MM_HINT_T0);
+#  else
+  __builtin_prefetch(addr);
+#  endif
+}
+
+#endif
+
+
+/// map_file() maps a whole file read-only in memory. An empty file is mapped
+/// to a null address with zero size. Returns false if the file cannot be opened
+/// or mapped.
+
+bool map_file(const char* fname, void** baseAddress, uint64_t* mapping, uint64_t* size) {
+
+  *baseAddress = nullptr;
+  *mapping = *size = 0;
+
+#ifndef _WIN32
+  struct stat statbuf;
+  int fd = ::open(fname, O_RDONLY);
+
+  if (fd == -1)
+      return false;
+
+  bool ok = !fstat(fd, &statbuf);
+
+  if (!ok || !statbuf.st_size)
+  {
+      ::close(fd);
+      return ok;
+  }
+
+  void* addr = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if (addr == MAP_FAILED)
+      return false;
+
+  *mapping = *size = statbuf.st_size;
+  *baseAddress = addr;
+#else
+  HANDLE fd = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (fd == INVALID_HANDLE_VALUE)
+      return false;
+
+  DWORD size_high;
+  DWORD size_low = GetFileSize(fd, &size_high);
+
+  if (!size_low && !size_high)
+  {
+      CloseHandle(fd);
+      return true;
+  }
+
+  HANDLE mmap = CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high, size_low, nullptr);
+  CloseHandle(fd);
+
+  if (!mmap)
+      return false;
+
+  void* addr = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0);
+
+  if (!addr)
+  {
+      CloseHandle(mmap);
+      return false;
+  }
+
+  *size = ((uint64_t)size_high << 32) | (uint64_t)size_low;
+  *mapping = (uint64_t)mmap;
+  *baseAddress = addr;
+#endif
+
+  return true;
+}
+
+
+/// unmap_file() releases a mapping returned by map_file()
+
+void unmap_file(void* baseAddress, uint64_t mapping) {
+
+  if (!baseAddress)
+      return;
+
+#ifndef _WIN32
+  munmap(baseAddress, mapping);
+#else
+  UnmapViewOfFile(baseAddress);
+  CloseHandle((HANDLE)mapping);
+#endif
+}
+
+
+/// list_files() returns the sorted paths of the files in a directory whose
+/// name ends with the given extension.
+
+vector<string> list_files(const string& dir, const string& ext) {
+
+  vector<string> files;
+
+  auto add = [&](const string& name) {
+      if (   name.size() > ext.size()
+          && name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+          files.push_back(dir + "/" + name);
+  };
+
+#ifndef _WIN32
+  DIR* d = opendir(dir.c_str());
+
+  if (d)
+  {
+      while (struct dirent* e = readdir(d))
+          add(e->d_name);
+
+      closedir(d);
+  }
+#else
+  WIN32_FIND_DATA data;
+  HANDLE h = FindFirstFile((dir + "\\*" + ext).c_str(), &data);
+
+  if (h != INVALID_HANDLE_VALUE)
+  {
+      do add(data.cFileName); while (FindNextFile(h, &data));
+
+      FindClose(h);
+  }
+#endif
+
+  sort(files.begin(), files.end());
+  return files;
+}
+
+
+/// glob_files() expands a file name with wildcards, like "pgn/2019-*.pgn", to
+/// the sorted paths of the matching files. A name without matches is returned
+/// as it is.
+
+vector<string> glob_files(const string& pattern) {
+
+  vector<string> files;
+
+#ifndef _WIN32
+  glob_t g;
+
+  if (!glob(pattern.c_str(), 0, nullptr, &g))
+      for (size_t i = 0; i < g.gl_pathc; ++i)
+          files.push_back(g.gl_pathv[i]);
+
+  globfree(&g);
+#else
+  size_t sep = pattern.find_last_of("\\/:");
+  string dir = sep == string::npos ? "" : pattern.substr(0, sep + 1);
+  WIN32_FIND_DATA data;
+  HANDLE h = FindFirstFile(pattern.c_str(), &data);
+
+  if (h != INVALID_HANDLE_VALUE)
+  {
+      do if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+             files.push_back(dir + data.cFileName);
+      while (FindNextFile(h, &data));
+
+      FindClose(h);
+  }
+#endif
+
+  if (files.empty())
+      files.push_back(pattern);
+
+  sort(files.begin(), files.end());
+  return files;
+}
+
+
+/// listen_socket() creates a Unix domain socket with the given name, removing
+/// the one left by a previous server, and listens for connections on it. The
+/// socket does not block, so that many threads can wait for clients on it.
+/// Returns the socket, or -1 on failure and on Windows, that has none.
+
+int listen_socket(const string& name) {
+
+#ifndef _WIN32
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+
+  if (name.size() >= sizeof(addr.sun_path))
+      return -1;
+
+  strcpy(addr.sun_path, name.c_str());
+  unlink(name.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0)
+      return -1;
+
+  if (   bind(fd, (sockaddr*)&addr, sizeof(addr))
+      || listen(fd, SOMAXCONN)
+      || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK))
+  {
+      close(fd);
+      return -1;
+  }
+
+  // A client can close the connection before reading the response
+  signal(SIGPIPE, SIG_IGN);
+  return fd;
+#else
+  (void)name;
+  return -1;
+#endif
+}
+
+
+/// accept_socket() returns the connection of a client waiting on a listening
+/// socket, or -1 if there is none, for instance because another thread took it.
+/// The connection does not block, so that a client that does not read its
+/// responses can not stall the server.
+
+int accept_socket(int fd) {
+
+#ifndef _WIN32
+  int client = accept(fd, nullptr, nullptr);
+
+  if (client >= 0 && fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK))
+  {
+      close(client);
+      return -1;
+  }
+
+  return client;
+#else
+  (void)fd;
+  return -1;
+#endif
+}
+
+
+/// poll_sockets() waits until some of the sockets are ready for the SocketEvent
+/// flags in 'events', and sets the ones they are ready for in 'ready'. A socket
+/// can be read when a client is waiting on a listening socket, or a connection
+/// has data or was closed, and written when a connection has room for more
+/// data. A wait interrupted by a signal is resumed. Returns the number of
+/// sockets ready, or -1 on failure, with errno set.
+
+int poll_sockets(const vector<int>& fds, const vector<int>& events, vector<int>& ready) {
+
+  ready.assign(fds.size(), 0);
+
+#ifndef _WIN32
+  vector<pollfd> pfds(fds.size());
+
+  for (size_t i = 0; i < fds.size(); ++i)
+      pfds[i] = { fds[i], short(  (events[i] & SOCKET_READ  ? POLLIN  : 0)
+                                | (events[i] & SOCKET_WRITE ? POLLOUT : 0)), 0 };
+
+  int n;
+
+  do n = poll(pfds.data(), pfds.size(), -1);
+  while (n < 0 && errno == EINTR);
+
+  // Errors are reported as ready, so that the failing call tells them
+  for (size_t i = 0; n > 0 && i < fds.size(); ++i)
+      ready[i] =  (pfds[i].revents & (POLLIN | POLLHUP | POLLERR) ? SOCKET_READ : 0)
+                | (pfds[i].revents & (POLLOUT | POLLERR) ? SOCKET_WRITE : 0);
+
+  return n;
+#else
+  (void)events;
+  return -1;
+#endif
+}
+
+
+/// read_socket() reads what is available from a connection. Returns the number
+/// of bytes read, zero if there is nothing to read yet, or -1 once the client
+/// has closed the connection or on failure.
+
+int64_t read_socket(int fd, char* buf, size_t size) {
+
+#ifndef _WIN32
+  ssize_t n = read(fd, buf, size);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 0;
+
+  return n > 0 ? n : -1;
+#else
+  (void)fd; (void)buf; (void)size;
+  return -1;
+#endif
+}
+
+
+/// write_socket() writes to a connection as much of the data as it takes
+/// without waiting. Returns the number of bytes written, zero if the connection
+/// is full, or -1 if the client has gone.
+
+int64_t write_socket(int fd, const string& data) {
+
+#ifndef _WIN32
+  ssize_t n = write(fd, data.data(), data.size());
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 0;
+
+  return n;
+#else
+  (void)fd; (void)data;
+  return -1;
+#endif
+}
+
+
+/// close_socket() closes a connection or a listening socket
+
+void close_socket(int fd) {
+
+#ifndef _WIN32
+  close(fd);
+#else
+  (void)fd;
+#endif
+}
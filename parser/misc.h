@@ -29,8 +29,20 @@
 
 #include "types.h"
 
+enum SocketEvent { SOCKET_READ = 1, SOCKET_WRITE = 2 };
+
 const std::string engine_info(bool to_uci = false);
 void prefetch(void* addr);
+bool map_file(const char* fname, void** baseAddress, uint64_t* mapping, uint64_t* size);
+void unmap_file(void* baseAddress, uint64_t mapping);
+std::vector<std::string> list_files(const std::string& dir, const std::string& ext);
+std::vector<std::string> glob_files(const std::string& pattern);
+int listen_socket(const std::string& name);
+int accept_socket(int fd);
+int poll_sockets(const std::vector<int>& fds, const std::vector<int>& events, std::vector<int>& ready);
+int64_t read_socket(int fd, char* buf, size_t size);
+int64_t write_socket(int fd, const std::string& data);
+void close_socket(int fd);
 void start_logger(const std::string& fname);
 
 void dbg_hit_on(bool b);
@@ -19,18 +19,24 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
 #include <sstream>
+#include <thread>
 
 #ifndef _WIN32
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #else
 #define WIN32_LEAN_AND_MEAN
@@ -38,10 +44,19 @@
 #define NOMINMAX
 #endif
 #include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 #include "book.h"
 #include "misc.h"
+#include "parser.h"
 #include "position.h"
 #include "uci.h"
 
@@ -49,11 +64,6 @@ namespace {
 
 typedef std::vector<PolyEntry> Keys;
 
-struct Stats {
-    int64_t games;
-    int64_t moves;
-    int64_t fixed;
-};
 
 enum Token {
     T_NONE, T_SPACES, T_RESULT, T_MINUS, T_DOT, T_QUOTES, T_DOLLAR,
@@ -64,105 +74,74 @@ enum Token {
 
 enum State {
     HEADER, TAG, FEN_TAG, BRACE_COMMENT, VARIATION, NUMERIC_ANNOTATION_GLYPH,
-    NEXT_MOVE, MOVE_NUMBER, NEXT_SAN, READ_SAN, RESULT, SKIP_GAME, STATE_NB
+    NEXT_MOVE, MOVE_NUMBER, NEXT_SAN, READ_SAN, RESULT, SKIP_GAME, BROKEN_VARIATION,
+    STATE_NB
 };
 
 enum Step : uint8_t {
     FAIL, CONTINUE, GAME_START, OPEN_TAG, OPEN_BRACE_COMMENT, READ_FEN, CLOSE_FEN_TAG,
     OPEN_VARIATION, START_NAG, POP_STATE, START_MOVE_NUMBER, START_NEXT_SAN,
-    CASTLE_OR_RESULT, START_READ_SAN, READ_MOVE_CHAR, END_MOVE, START_RESULT,
-    END_GAME, TAG_IN_BRACE, MISSING_RESULT
+    CASTLE_OR_RESULT, START_READ_SAN, END_MOVE, START_RESULT,
+    END_GAME, TAG_IN_BRACE, MISSING_RESULT, OPEN_RAV, CLOSE_RAV
 };
 
 enum MetaType {
     MOVE_TOTAL, MOVE_WIN, MOVE_DRAW
 };
 
+// Characters that can change state when found in a given state. States with
+// a short list of them, like TAG or BRACE_COMMENT, are skipped with SIMD.
+struct StopChars {
+    int count;
+    char chars[4];
+};
+
+const char EventTag[] = "\n[Event ";
+const size_t StreamWindow = 64 * 1024 * 1024;
+const uint64_t ProgressSlice = 64 * 1024 * 1024; // Bytes parsed between reports
+const int MaxRavDepth = 8; // Deeper variations are skipped
+const size_t MaxRequestSize = 64 * 1024; // Of a 'serve' request
+const size_t MaxBacklog = 1024 * 1024; // Of the responses a client has not read
+
 Token ToToken[256];
 Step ToStep[STATE_NB][TOKEN_NB];
+Step ToStepRav[STATE_NB][TOKEN_NB]; // Same as ToStep, but reading variations
+StopChars ToStop[STATE_NB];
 Position RootPos;
+PolyglotBook Book; // Kept mapped across find commands
 
-void map(const char* fname, void** baseAddress, uint64_t* mapping, uint64_t* size) {
+/// is_mappable() returns true if fname is a regular file. Pipes and character
+/// devices, like '-' or /dev/stdin, cannot be mmapped and are streamed instead.
+
+bool is_mappable(const std::string& fname) {
 
 #ifndef _WIN32
     struct stat statbuf;
-    int fd = ::open(fname, O_RDONLY);
-    fstat(fd, &statbuf);
-    *mapping = *size = statbuf.st_size;
-    *baseAddress = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    ::close(fd);
-    if (*baseAddress == MAP_FAILED)
-    {
-        std::cerr << "Could not mmap() " << fname << std::endl;
-        exit(1);
-    }
+    return fname != "-" && !stat(fname.c_str(), &statbuf) && S_ISREG(statbuf.st_mode);
 #else
-    HANDLE fd = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ, nullptr,
-                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-    DWORD size_high;
-    DWORD size_low = GetFileSize(fd, &size_high);
-    HANDLE mmap = CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high, size_low, nullptr);
-    CloseHandle(fd);
-    if (!mmap)
-    {
-        std::cerr << "CreateFileMapping() failed" << std::endl;
-        exit(1);
-    }
-    *size = ((size_t)size_high << 32) | (size_t)size_low;
-    *mapping = (uint64_t)mmap;
-    *baseAddress = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0);
-    if (!*baseAddress)
-    {
-        std::cerr << "MapViewOfFile() failed, name = " << fname
-                  << ", error = " << GetLastError() << std::endl;
-        exit(1);
-    }
+    return fname != "-";
 #endif
 }
 
-void unmap(void* baseAddress, uint64_t mapping) {
+/// error() returns the message for a PGN that can not be parsed, with the state
+/// of the parser and the text where it failed.
 
-#ifndef _WIN32
-    munmap(baseAddress, mapping);
-#else
-    UnmapViewOfFile(baseAddress);
-    CloseHandle((HANDLE)mapping);
-#endif
-}
-
-void error(Step* state, const char* data) {
+std::string error(Step* state, const char* data, const char* eof) {
 
     std::vector<std::string> stateDesc = {
         "HEADER", "TAG", "FEN_TAG", "BRACE_COMMENT", "VARIATION",
         "NUMERIC_ANNOTATION_GLYPH", "NEXT_MOVE", "MOVE_NUMBER",
-        "NEXT_SAN", "READ_SAN", "RESULT"
+        "NEXT_SAN", "READ_SAN", "RESULT", "SKIP_GAME", "BROKEN_VARIATION"
     };
 
     for (int i = 0; i < STATE_NB; i++)
-        if (ToStep[i] == state)
-        {
-            std::string what = std::string(data, 50);
-            std::cerr << "Wrong " << stateDesc[i] << ": '"
-                      << what << "' " << std::endl;
-        }
-    exit(0);
-}
+        if (ToStep[i] == state || ToStepRav[i] == state)
+            return "Wrong " + stateDesc[i] + ": '"
+                 + std::string(data, std::min(eof - data, ptrdiff_t(50))) + "'";
 
-
-template<typename T> void read_entry(T& n, std::ifstream& ifs) {
-
-    n = 0;
-    for (size_t i = 0; i < sizeof(T); ++i)
-        n = T((n << 8) + ifs.get());
+    return "Wrong PGN";
 }
 
-template<> void read_entry(PolyEntry& e, std::ifstream& ifs) {
-
-  read_entry(e.key, ifs);
-  read_entry(e.move, ifs);
-  read_entry(e.weight, ifs);
-  read_entry(e.learn, ifs);
-}
 
 /// Convert a number of type T into a sequence of bytes in big-endian format
 
@@ -174,6 +153,17 @@ template<typename T> uint8_t* write(const T& n, uint8_t* data) {
     return data;
 }
 
+/// Convert a sequence of bytes in big-endian format into a number of type T
+
+template<typename T> T read(const uint8_t* data) {
+
+    T n = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        n = T((n << 8) + data[i]);
+
+    return n;
+}
+
 template<> uint8_t* write(const PolyEntry& e, uint8_t* data) {
 
     data = write(e.key,    data);
@@ -182,341 +172,1630 @@ template<> uint8_t* write(const PolyEntry& e, uint8_t* data) {
     return write(e.learn,  data);
 }
 
-size_t write_poly_file(const Keys& kTable, const std::string& fname, bool full) {
-
-    uint8_t data[SizeOfPolyEntry];
-    std::ofstream ofs;
-    ofs.open(fname, std::ofstream::out | std::ofstream::binary);
+template<> uint8_t* write(const SumEntry& e, uint8_t* data) {
 
-    const PolyEntry dummy = PolyEntry();
-    const PolyEntry* prev = &dummy;
+    data = write(e.key,    data);
+    data = write(e.move,   data);
+    data = write(e.weight, data);
 
-    for (const PolyEntry& e : kTable)
-        if (e.key != prev->key || e.move != prev->move || full)
-        {
-            write(e, data);
-            ofs.write((char*)data, SizeOfPolyEntry);
-            prev = &e;
-        }
+    for (uint32_t r : e.results)
+        data = write(r, data);
 
-    size_t size = ofs.tellp();
-    ofs.close();
-    return size;
+    return write(e.first,  data);
 }
 
-size_t sort_by_frequency(Keys& kTable, size_t start, size_t end) {
+/// BookWriter writes the sorted entries to the book file, in normal mode only
+/// once per (key, move). With a summary, it also writes a record per
+/// (key, move) to the summary file, so that find does not need to walk all
+/// the entries of popular positions. A summary left by a previous build is
+/// removed otherwise.
 
-    std::map<PMove, int> moves;
+struct BookWriter {
 
-    for (size_t i = start; i < end; ++i)
-        moves[kTable[i].move]++;
+    BookWriter(const std::string& fname, bool full, bool summary);
+    void write(const PolyEntry* begin, const PolyEntry* end);
+    size_t close();
 
-    // Normalize weights to be stored in a uint16_t, so that 100% -> 0xFFFF
-    for (size_t i = start; i < end; ++i)
-        kTable[i].weight = moves[kTable[i].move] * 0xFFFF / (end - start);
+private:
+    void flush();
 
-    std::sort(kTable.begin() + start, kTable.begin() + end,
-              [](const PolyEntry& a, const PolyEntry& b) -> bool
-    {
-        return    a.weight > b.weight
-              || (a.weight == b.weight && a.move > b.move);
-    });
+    std::ofstream ofs, sum;
+    std::string sumName;
+    bool full;
+    uint64_t entries = 0;
+    PolyEntry last = PolyEntry();
+    SumEntry cur = SumEntry();
+};
 
-    return end;
-}
+BookWriter::BookWriter(const std::string& fname, bool f, bool summary)
+    : sumName(fname + ".sum"), full(f) {
 
-inline PMove to_polyglot(Move m) {
-    // A PolyGlot book move is encoded as follows:
-    //
-    // bit  0- 5: destination square (from 0 to 63)
-    // bit  6-11: origin square (from 0 to 63)
-    // bit 12-13: promotion piece (from KNIGHT == 1 to QUEEN == 4)
-    //
-    // Castling moves follow the "king captures rook" representation. If a book
-    // move is a promotion, we have to convert it to our representation and in
-    // all other cases, we can directly compare with a Move after having masked
-    // out the special Move flags (bit 14-15) that are not supported by PolyGlot.
-    if (type_of(m) == PROMOTION)
-        return PMove((m & 0xFFF) | ((promotion_type(m) - 1) << 12));
+    ofs.open(fname, std::ofstream::out | std::ofstream::binary);
 
-    return PMove(m & 0x3FFF);
+    if (!summary)
+    {
+        std::remove(sumName.c_str());
+        return;
+    }
+
+    // Header is rewritten on close() with the number of entries
+    uint8_t data[SizeOfSumHeader] = {};
+    sum.open(sumName, std::ofstream::out | std::ofstream::binary);
+    sum.write((char*)data, SizeOfSumHeader);
 }
 
-template<bool DryRun = false>
-const char* parse_game(const char* moves, const char* end, Keys& kTable,
-                       const char* fen, const char* fenEnd, size_t& fixed,
-                       uint64_t gameOfs, int result) {
+void BookWriter::write(const PolyEntry* begin, const PolyEntry* end) {
 
-    StateInfo states[1024], *st = states;
-    Position pos = RootPos;
-    const char *cur = moves;
+    uint8_t data[SizeOfPolyEntry];
 
-    if (fenEnd != fen)
-        pos.set(fen, false, st++);
+    for (const PolyEntry* e = begin; e < end; ++e)
+    {
+        bool newMove = e->key != last.key || e->move != last.move;
 
-    // Use Polyglot 'learn' parameter to store game result in the upper 2 bits,
-    // and game offset in the PGN file. Note that the offset is 8 bytes aligned
-    // and points to "somewhere" in the game. It is up to the look up tool to
-    // find game's boundaries. This allow us to index up to 8GB PGN files.
-    // Result is stored in the upper 2 bits so that sorting by 'learn' allows
-    // easy counting of result statistics.
+        if (!newMove && !full)
+            continue;
 
-    // upper 2 bits out of 32 bits store the result
-    const uint32_t learn =  ((uint32_t(result) & 3) << 30)
-                          | ((gameOfs >> 3) & 0x3FFFFFFF);
-    while (cur < end)
-    {
-        Move move = pos.san_to_move(cur, end, fixed);
-        if (move == MOVE_NONE)
+        if (newMove)
         {
-            if (!DryRun)
-            {
-                const char* sep = pos.side_to_move() == WHITE ? "" : "..";
-                std::cerr << "\nWrong move notation: " << sep << cur
-                          << "\n" << pos << std::endl;
-
-            }
-            return cur;
+            flush();
+            cur = SumEntry();
+            cur.key = e->key;
+            cur.move = e->move;
+            cur.weight = e->weight;
+            cur.first = entries;
         }
-        else if (move == MOVE_NULL)
-            pos.do_null_move(*st++);
-        else
-        {
-            if (!DryRun)
-                kTable.push_back({pos.key(), to_polyglot(move), 1, learn});
 
-            pos.do_move(move, *st++, pos.gives_check(move));
-        }
+        cur.results[(e->learn >> 30) & 3]++;
+        ::write(*e, data);
+        ofs.write((char*)data, SizeOfPolyEntry);
+        entries++;
+        last = *e;
+    }
+}
+
+void BookWriter::flush() {
+
+    uint8_t data[SizeOfSumEntry];
 
-        while (*cur++) {} // Go to next move
+    if (sum.is_open() && cur.results[0] + cur.results[1] + cur.results[2] + cur.results[3])
+    {
+        ::write(cur, data);
+        sum.write((char*)data, SizeOfSumEntry);
     }
-    return end;
 }
 
-int get_result(const char* data) {
+size_t BookWriter::close() {
 
-    // Result is coded from 0 to 3 as WHITE_WIN, BLACK_WIN, DRAW, RESULT_UNKNOWN.
-    // START_RESULT is triggered by '/', '*', '0', '-'.
-    switch (*data) {
-    case '/':
-        return 2;
-    case '0':
-        return 1;
-    case '-':
-        if (    *(data-1) == '1'
-            || (*(data-1) == ' ' && *(data-2) == '1')) // Like '1 - 0'
-            return 0;
-        else if (    *(data-1) == '0'
-                 || (*(data-1) == ' ' && *(data-2) == '0'))
-            return 1;
-        break;
-    default:
-        break;
+    if (sum.is_open())
+    {
+        uint8_t data[SizeOfSumHeader];
+
+        flush();
+        ::write(entries, ::write(SumMagic, data));
+        sum.seekp(0);
+        sum.write((char*)data, SizeOfSumHeader);
+        sum.close();
     }
-    return 3;
+
+    size_t size = ofs.tellp();
+    ofs.close();
+    return size;
 }
 
-void parse_pgn(void* baseAddress, uint64_t size, Stats& stats, Keys& kTable) {
+template<> uint8_t* write(const GameEntry& g, uint8_t* data) {
 
-    Step* stateStack[16];
-    Step**stateSp = stateStack;
-    char fen[256], *fenEnd = fen;
-    char moves[1024 * 8], *curMove = moves;
-    char* end = curMove;
-    size_t moveCnt = 0, gameCnt = 0, fixed = 0;
-    uint64_t gameOfs = 0;
-    int result = 3;
-    char* data = (char*)baseAddress;
-    char* eof = data + size;
-    int stm = WHITE;
-    Step* state = ToStep[HEADER];
+    data = write(g.ofs, data);
+    data = write(g.len, data);
+    return write(g.file, data);
+}
 
-    for (  ; data < eof; ++data)
-    {
-        Token tk = ToToken[*(uint8_t*)data];
+/// GameTable writes the game table next to the book while the PGN is parsed.
+/// Games are appended in file order, so that the index of a game in the table
+/// is its id. The header is written on close(), when the book is done. When a
+/// book is updated the games already in the table are copied first, and the new
+/// games are appended to them. The games of a PGN file are appended after
+/// add_file().
 
-        switch (state[tk])
-        {
-        case FAIL:
-            error(state, data);
-            break;
+struct GameTable {
 
-        case CONTINUE:
-            break;
+    struct PgnFile {
+        std::string name;
+        uint64_t size; // Bytes indexed
+    };
 
-        case GAME_START:
-            if (!strncmp(data-1, "[Event ", 7))
-            {
-                data -= 2;
-                state = ToStep[HEADER];
-            }
-            break;
+    bool open(const std::string& fname, bool update = false);
+    PgnFile& add_file(const std::string& name);
+    bool append(const std::vector<GameEntry>& games);
+    void close(uint64_t bookEntries);
+    void abort();
 
-        case OPEN_TAG:
-            *stateSp++ = state;
-            if (*(data + 1) == 'F' && !strncmp(data+1, "FEN \"", 5))
-            {
-                data += 5;
-                state = ToStep[FEN_TAG];
-            }
-            else if (   *(data + 1) == 'V'
-                     && !strncmp(data+1, "Variant ", 8)
-                     &&  strncmp(data+9, "\"Standard\"", 10))
-            {
-                --stateSp; // Pop state, we are inside brackets
-                state = ToStep[SKIP_GAME];
-            }
-            else
-                state = ToStep[TAG];
-            break;
+    uint64_t count = 0;
+    uint64_t flags = 0;
+    std::vector<PgnFile> files;
 
-        case OPEN_BRACE_COMMENT:
-            *stateSp++ = state;
-            state = ToStep[BRACE_COMMENT];
-            break;
+private:
+    std::ofstream ofs;
+    std::string tableName; // Written aside with .tmp appended
+    uint32_t file = 0; // Index of the file being parsed
+};
 
-        case READ_FEN:
-            *fenEnd++ = *data;
-            break;
+/// GameTable::open() creates the table aside, renamed over the old one on
+/// close(). On update the games of the old table are copied there, so that
+/// the old table is untouched until the new one is complete. Returns false if
+/// the table to update is missing, old or broken.
 
-        case CLOSE_FEN_TAG:
-            *fenEnd++ = 0; // Zero-terminating string
-            state = ToStep[TAG];
-            if (strstr(fen, " b "))
-                stm = BLACK;
-            break;
+bool GameTable::open(const std::string& fname, bool update) {
 
-        case OPEN_VARIATION:
-            *stateSp++ = state;
-            state = ToStep[VARIATION];
-            break;
+    uint8_t data[SizeOfGameHeader] = {};
 
-        case START_NAG:
-            *stateSp++ = state;
-            state = ToStep[NUMERIC_ANNOTATION_GLYPH];
-            break;
+    tableName = fname;
+    ofs.open(tableName + ".tmp", std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    ofs.write((char*)data, SizeOfGameHeader);
 
-        case POP_STATE:
-            state = *(--stateSp);
-            break;
+    if (!update)
+        return true;
 
-        case START_MOVE_NUMBER:
-            state = ToStep[MOVE_NUMBER];
-            break;
+    std::ifstream ifs(fname, std::ifstream::in | std::ifstream::binary);
 
-        case START_NEXT_SAN:
-            state = ToStep[NEXT_SAN];
-            break;
+    if (   !ifs.read((char*)data, SizeOfGameHeader)
+        || read<uint64_t>(data) != GameMagic)
+    {
+        abort();
+        return false;
+    }
 
-        case CASTLE_OR_RESULT:
-            if (data[2] != '0')
-            {
-                assert (result == 3);
+    count = read<uint64_t>(data + 8);
+    flags = read<uint64_t>(data + 24);
 
-                result = get_result(data);
-                state = ToStep[RESULT];
-                continue;
-            }
-            /* Fall through */
+    std::vector<char> buf(1 << 20);
 
-        case START_READ_SAN:
-            *end++ = *data;
-            state = ToStep[READ_SAN];
-            break;
+    for (uint64_t left = count * SizeOfGameEntry; left && ifs; )
+    {
+        size_t n = size_t(std::min(left, uint64_t(buf.size())));
+        ifs.read(buf.data(), n);
+        ofs.write(buf.data(), n);
+        left -= n;
+    }
 
-        case READ_MOVE_CHAR:
-            *end++ = *data;
-            break;
+    for (uint64_t n = read<uint64_t>(data + 16); n && ifs; --n)
+    {
+        PgnFile f;
+        uint8_t b[12];
+
+        ifs.read((char*)b, 12);
+        f.size = read<uint64_t>(b);
+        f.name.resize(read<uint32_t>(b + 8));
+        ifs.read(&f.name[0], f.name.size());
+        files.push_back(f);
+    }
 
-        case END_MOVE:
-            *end++ = 0; // Zero-terminating string
-            curMove = end;
-            moveCnt++;
-            state = ToStep[stm == WHITE ? NEXT_SAN : NEXT_MOVE];
-            stm ^= 1;
-            break;
+    if (!ifs || !ofs)
+    {
+        abort();
+        return false;
+    }
 
-        case START_RESULT:
-            assert (result == 3);
+    return true;
+}
 
-            result = get_result(data);
-            state = ToStep[RESULT];
-            break;
+/// GameTable::add_file() sets the file of the games appended next and returns
+/// its record. A file already in the table keeps its index and the size
+/// indexed, so that only the bytes after that are parsed.
 
-        case END_GAME:
-            if (*data != '\n') // Handle spaces in result, like 1/2 - 1/2
-            {
-                state = ToStep[RESULT];
-                break;
-            }
-            parse_game(moves, end, kTable, fen, fenEnd, fixed, gameOfs, result);
-            gameCnt++;
-            result = 3;
-            gameOfs = (data - (char*)baseAddress) + 1; // Beginning of next game
-            end = curMove = moves;
-            fenEnd = fen;
-            state = ToStep[HEADER];
-            stm = WHITE;
-            break;
+GameTable::PgnFile& GameTable::add_file(const std::string& name) {
 
-        case TAG_IN_BRACE:
-             // Special case of missed brace close. Detect beginning of next game
-             if (strncmp(data, "[Event ", 7))
-                 break;
+    for (file = 0; file < files.size(); ++file)
+        if (files[file].name == name)
+            return files[file];
 
-             /* Fall through */
+    files.push_back({ name, 0 });
+    return files.back();
+}
 
-        case MISSING_RESULT: // Missing result, next game already started
-            parse_game(moves, end, kTable, fen, fenEnd, fixed, gameOfs, result);
-            gameCnt++;
-            result = 3;
-            gameOfs = (data - (char*)baseAddress); // Beginning of next game
-            end = curMove = moves;
-            fenEnd = fen;
-            state = ToStep[HEADER];
-            stm = WHITE;
+/// GameTable::append() writes the games of the file being parsed. Returns false
+/// if there are too many games for the ids stored in the book.
 
-            *stateSp++ = state; // Fast forward into a TAG
-            state = ToStep[TAG];
-            break;
+bool GameTable::append(const std::vector<GameEntry>& games) {
 
-        default:
-            assert(false);
-            break;
-        }
-    }
+    uint8_t data[SizeOfGameEntry];
 
-    // Force accounting of last game if still pending. Many reason for this to
-    // trigger: no newline at EOF, missing result, missing closing brace, etc.
-    if (state != ToStep[HEADER] && state != ToStep[SKIP_GAME] && end - moves)
+    if (count + games.size() > GameIdMask + 1)
+        return false;
+
+    for (GameEntry g : games)
     {
-        parse_game(moves, end, kTable, fen, fenEnd, fixed, gameOfs, result);
-        gameCnt++;
+        g.file = file;
+        write(g, data);
+        ofs.write((char*)data, SizeOfGameEntry);
     }
 
-    stats.games = gameCnt;
-    stats.moves = moveCnt;
-    stats.fixed = fixed;
+    count += games.size();
+    return true;
 }
 
-} // namespace
+void GameTable::close(uint64_t bookEntries) {
 
-const char* play_game(const Position& pos, Move move, const char* cur, const char* end) {
+    uint8_t data[SizeOfGameHeader];
 
-    size_t fixed;
-    Keys k;
-    StateInfo st;
-    Position p = pos;
-    p.do_move(move, st, pos.gives_check(move));
-    while (*cur++) {} // Move to next move in game
-    return cur < end ? parse_game<true>(cur, end, k, p.fen().c_str(),
-                                        nullptr, fixed, 0, 3) : cur;
+    for (const PgnFile& f : files)
+    {
+        write(uint32_t(f.name.size()), write(f.size, data));
+        ofs.write((char*)data, 12);
+        ofs.write(f.name.data(), f.name.size());
+    }
+
+    write(bookEntries, write(flags, write(uint64_t(files.size()), write(count, write(GameMagic, data)))));
+    ofs.seekp(0);
+    ofs.write((char*)data, SizeOfGameHeader);
+    ofs.close();
+
+    std::remove(tableName.c_str());
+    std::rename((tableName + ".tmp").c_str(), tableName.c_str());
 }
 
-namespace Parser {
+/// GameTable::abort() is called when the book can not be built. The table
+/// written aside is removed, the old one, if any, is left as it was.
 
+void GameTable::abort() {
 
-void init() {
+    ofs.close();
+    std::remove((tableName + ".tmp").c_str());
+}
+
+/// game_order() returns the position of the game in the PGN, as stored in the
+/// lower 30 bits of 'learn', with the moves of the variations after the ones of
+/// the main lines. Entries are sorted by key, game and move, so that
+/// the book does not depend on the sorting algorithm, on the number of threads
+/// or on the memory budget.
+
+inline uint32_t game_order(const PolyEntry& e) {
+    return e.learn & 0x3FFFFFFF;
+}
+
+inline bool by_key(const PolyEntry& a, const PolyEntry& b) {
+    return    a.key < b.key
+          || (a.key == b.key && game_order(a) < game_order(b))
+          || (a.key == b.key && game_order(a) == game_order(b) && a.move < b.move);
+}
+
+/// run_parallel() calls f(t) for each thread index t in [0, threads), the
+/// first one in the calling thread, and waits for all of them to finish.
+
+template<typename F>
+void run_parallel(size_t threads, F f) {
+
+    std::vector<std::thread> workers;
+
+    for (size_t t = 1; t < threads; ++t)
+        workers.emplace_back(f, t);
+
+    f(0);
+
+    for (std::thread& th : workers)
+        th.join();
+}
+
+/// by_frequency() is the order of the moves of a key in the book: by weight,
+/// then by move and, for the same move, by game.
+
+inline bool by_frequency(const PolyEntry& a, const PolyEntry& b) {
+    return    a.weight > b.weight
+          || (a.weight == b.weight && a.move > b.move)
+          || (a.weight == b.weight && a.move == b.move && game_order(a) < game_order(b));
+}
+
+/// sort_by_frequency() weights the moves of a key by how often they have been
+/// played and sorts them by_frequency(). The entries of a key are the legal
+/// moves of the same position, so they are counted in a small table on the
+/// stack. Only on a key collision could there be more distinct moves, then the
+/// range is sorted by move and the counts are the lengths of the runs.
+
+void sort_by_frequency(Keys& kTable, size_t start, size_t end) {
+
+    struct MoveCount { PMove move; uint64_t cnt; };
+
+    MoveCount counts[MAX_MOVES];
+    PolyEntry* first = &kTable[start];
+    PolyEntry* last = first + (end - start);
+    const uint64_t total = end - start;
+    int size = 0;
+
+    for (PolyEntry* e = first; e < last && size <= MAX_MOVES; ++e)
+    {
+        int i = 0;
+        while (i < size && counts[i].move != e->move)
+            ++i;
+
+        if (i == size && size++ < MAX_MOVES)
+            counts[i] = { e->move, 0 };
+
+        if (i < MAX_MOVES)
+            counts[i].cnt++;
+    }
+
+    // Normalize weights to be stored in a uint16_t, so that 100% -> 0xFFFF
+    if (size <= MAX_MOVES)
+        for (PolyEntry* e = first; e < last; ++e)
+        {
+            int i = 0;
+            while (counts[i].move != e->move)
+                ++i;
+
+            e->weight = uint16_t(counts[i].cnt * 0xFFFF / total);
+        }
+    else
+    {
+        std::sort(first, last, [](const PolyEntry& a, const PolyEntry& b) {
+            return a.move < b.move;
+        });
+
+        for (PolyEntry *e = first, *run = first; e <= last; ++e)
+            if (e == last || e->move != run->move)
+            {
+                uint16_t weight = uint16_t(uint64_t(e - run) * 0xFFFF / total);
+
+                for ( ; run < e; ++run)
+                    run->weight = weight;
+            }
+    }
+
+    std::sort(first, last, by_frequency);
+}
+
+/// weight_keys() calls sort_by_frequency() on the keys of the sorted table
+/// with more than two entries and returns the number of unique keys. Keys are
+/// independent, so the table is split among the threads at key boundaries.
+
+size_t weight_keys(Keys& kTable, size_t threads) {
+
+    const size_t n = kTable.size();
+    std::vector<size_t> cuts(threads + 1, n), uniqueKeys(threads);
+
+    cuts[0] = 0;
+    for (size_t t = 1; t < threads; ++t)
+    {
+        size_t c = std::max(t * n / threads, cuts[t - 1]);
+        while (c > 0 && c < n && kTable[c].key == kTable[c - 1].key)
+            ++c;
+        cuts[t] = c;
+    }
+
+    run_parallel(threads, [&](size_t t) {
+
+        for (size_t idx = cuts[t] + 1, last = cuts[t]; idx <= cuts[t + 1]; ++idx)
+            if (idx == cuts[t + 1] || kTable[idx].key != kTable[idx - 1].key)
+            {
+                if (idx - last > 2)
+                    sort_by_frequency(kTable, last, idx);
+
+                last = idx;
+                uniqueKeys[t]++;
+            }
+    });
+
+    size_t sum = 0;
+    for (size_t u : uniqueKeys)
+        sum += u;
+
+    return sum;
+}
+
+/// radix_sort() sorts the key table with a parallel LSD radix sort on the keys,
+/// that being Zobrist hashes are uniformly distributed. Each pass every thread
+/// counts the digits of its slice and then scatters it to the offsets computed
+/// out of all the counts. Radix sort is stable, so entries with the same key
+/// stay in file order, that is game order, and the result is the same of a
+/// std::sort() with by_key() once positions repeated in the same game are
+/// ordered by move.
+
+void radix_sort(Keys& kTable, size_t threads) {
+
+    const int Bits = 11;
+    const size_t Buckets = 1 << Bits;
+    const size_t n = kTable.size();
+
+    threads = std::max(std::min(threads, n / Buckets), size_t(1));
+
+    Keys tmp(n);
+    PolyEntry* src = kTable.data();
+    PolyEntry* dst = tmp.data();
+    std::vector<size_t> counts(threads * Buckets);
+
+    for (int shift = 0; shift < 64; shift += Bits)
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+
+        run_parallel(threads, [&](size_t t) {
+
+            size_t* cnt = &counts[t * Buckets];
+            for (size_t i = t * n / threads; i < (t + 1) * n / threads; ++i)
+                cnt[(src[i].key >> shift) & (Buckets - 1)]++;
+        });
+
+        // Turn counts into offsets, digit major and thread minor, so that each
+        // thread writes its part of every bucket after the previous threads.
+        // Skip the pass if all the keys have the same digit.
+        size_t sum = 0, maxBucket = 0;
+        for (size_t d = 0; d < Buckets; ++d)
+        {
+            size_t bucket = 0;
+            for (size_t t = 0; t < threads; ++t)
+            {
+                size_t c = counts[t * Buckets + d];
+                counts[t * Buckets + d] = sum;
+                sum += c;
+                bucket += c;
+            }
+            maxBucket = std::max(maxBucket, bucket);
+        }
+
+        if (maxBucket == n)
+            continue;
+
+        run_parallel(threads, [&](size_t t) {
+
+            size_t* ofs = &counts[t * Buckets];
+            for (size_t i = t * n / threads; i < (t + 1) * n / threads; ++i)
+                dst[ofs[(src[i].key >> shift) & (Buckets - 1)]++] = src[i];
+        });
+
+        std::swap(src, dst);
+    }
+
+    if (src != kTable.data())
+        kTable.swap(tmp);
+
+    Keys().swap(tmp);
+
+    for (size_t i = 0, j; i < n; i = j)
+    {
+        for (j = i + 1; j < n && kTable[j].key == kTable[i].key; ++j) {}
+
+        if (!std::is_sorted(kTable.begin() + i, kTable.begin() + j, by_key))
+            std::sort(kTable.begin() + i, kTable.begin() + j, by_key);
+    }
+}
+
+/// Runs is the set of sorted runs spilled to disk by the parsing threads when
+/// their key table exceeds the memory budget. Runs are then merged back while
+/// writing the book, so that peak memory does not depend on the PGN size.
+
+struct Runs {
+
+   ~Runs();
+    size_t new_slot();
+    bool spill(Keys& kTable, size_t slot = 0);
+    bool merge(BookWriter& writer, size_t& uniqueKeys);
+
+    std::string prefix;
+    std::string error; // The first file that could not be written or read
+    size_t budget = size_t(-1); // Max number of entries in a key table
+    std::vector<std::string> files;
+    std::vector<size_t> fileSlot;
+    std::vector<uint64_t> slotBase = { 0 }; // Slot 0 is for global game ids
+    std::mutex mutex;
+};
+
+/// Runs::new_slot() reserves a slot for the first game id of a chunk that is
+/// parsed concurrently with the previous ones, so that its entries are spilled
+/// with game ids local to the chunk, and are fixed once the slot is set.
+
+size_t Runs::new_slot() {
+
+    std::unique_lock<std::mutex> lk(mutex);
+    slotBase.push_back(0);
+    return slotBase.size() - 1;
+}
+
+/// Runs::~Runs() removes the runs left when the book can not be built
+
+Runs::~Runs() {
+
+    for (const std::string& fname : files)
+        remove(fname.c_str());
+}
+
+/// Runs::spill() sorts the key table and writes it to a new run. Returns false,
+/// and sets the error, if the run can not be written.
+
+bool Runs::spill(Keys& kTable, size_t slot) {
+
+    std::string fname;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        fname = prefix + ".run" + std::to_string(files.size());
+        files.push_back(fname);
+        fileSlot.push_back(slot);
+    }
+
+    std::sort(kTable.begin(), kTable.end(), by_key);
+
+    FILE* f = fopen(fname.c_str(), "wb");
+    bool ok = f && fwrite(kTable.data(), sizeof(PolyEntry), kTable.size(), f) == kTable.size();
+
+    if (f && fclose(f))
+        ok = false;
+
+    if (!ok)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        if (error.empty())
+            error = "Could not write " + fname;
+        return false;
+    }
+
+    kTable.clear();
+    return true;
+}
+
+/// Runs::merge() does a k-way merge of the runs and writes the book one key at
+/// a time, weighting the moves of each key with sort_by_frequency(). Read
+/// buffers share the memory budget. Returns false, and sets the error, if a run
+/// can not be read.
+
+bool Runs::merge(BookWriter& writer, size_t& uniqueKeys) {
+
+    struct Run {
+        FILE* f;
+        Keys buf;
+        size_t cur, len;
+        uint32_t base; // Added to the game ids, that are local to its chunk
+    };
+
+    typedef std::pair<PolyEntry, size_t> Item; // Entry and its run
+    auto cmp = [](const Item& a, const Item& b) { return by_key(b.first, a.first); };
+    std::priority_queue<Item, std::vector<Item>, decltype(cmp)> queue(cmp);
+
+    std::vector<Run> runs(files.size());
+    size_t bufSize = budget == size_t(-1) ? 1 << 16 : std::max(budget / files.size(), size_t(1024));
+
+    auto next = [&](size_t i) {
+
+        Run& r = runs[i];
+        if (r.cur == r.len)
+        {
+            r.len = fread(r.buf.data(), sizeof(PolyEntry), r.buf.size(), r.f);
+            r.cur = 0;
+
+            for (size_t j = 0; j < r.len; ++j)
+                r.buf[j].learn += r.base;
+        }
+        if (r.cur < r.len)
+            queue.push(Item(r.buf[r.cur++], i));
+    };
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        runs[i].f = fopen(files[i].c_str(), "rb");
+        runs[i].buf.resize(bufSize);
+        runs[i].cur = runs[i].len = 0;
+        runs[i].base = uint32_t(slotBase[fileSlot[i]]);
+
+        if (!runs[i].f)
+        {
+            for (size_t j = 0; j < i; ++j)
+                fclose(runs[j].f);
+
+            error = "Could not read " + files[i];
+            return false;
+        }
+        next(i);
+    }
+
+    Keys group;
+    uniqueKeys = 0;
+
+    while (!queue.empty())
+    {
+        Item item = queue.top();
+        queue.pop();
+        next(item.second);
+
+        group.push_back(item.first);
+
+        if (queue.empty() || queue.top().first.key != item.first.key)
+        {
+            if (group.size() > 2)
+                sort_by_frequency(group, 0, group.size());
+
+            writer.write(group.data(), group.data() + group.size());
+            group.clear();
+            uniqueKeys++;
+        }
+    }
+
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        fclose(runs[i].f);
+        remove(files[i].c_str());
+    }
+
+    files.clear();
+    return true;
+}
+
+/// merge_book() merges the sorted entries of the new games of an update into
+/// the entries of the book, one key at a time, and writes the updated book.
+/// Only the keys with new entries are weighted again with sort_by_frequency(),
+/// the others are copied as they are. Returns the number of unique keys.
+
+size_t merge_book(const PolyglotBook& book, const Keys& kTable, BookWriter& writer) {
+
+    Keys group;
+    size_t i = 0, j = 0, uniqueKeys = 0;
+
+    while (i < book.size() || j < kTable.size())
+    {
+        Key key =   j == kTable.size()
+                 || (i < book.size() && book[i].key < kTable[j].key) ? book[i].key : kTable[j].key;
+
+        for ( ; i < book.size() && book[i].key == key; ++i)
+            group.push_back(book[i]);
+
+        size_t old = group.size();
+
+        for ( ; j < kTable.size() && kTable[j].key == key; ++j)
+            group.push_back(kTable[j]);
+
+        if (group.size() > old)
+        {
+            std::sort(group.begin(), group.end(), by_key);
+
+            if (group.size() > 2)
+                sort_by_frequency(group, 0, group.size());
+        }
+
+        writer.write(group.data(), group.data() + group.size());
+        group.clear();
+        uniqueKeys++;
+    }
+
+    return uniqueKeys;
+}
+
+inline PMove to_polyglot(Move m) {
+    // A PolyGlot book move is encoded as follows:
+    //
+    // bit  0- 5: destination square (from 0 to 63)
+    // bit  6-11: origin square (from 0 to 63)
+    // bit 12-13: promotion piece (from KNIGHT == 1 to QUEEN == 4)
+    //
+    // Castling moves follow the "king captures rook" representation. If a book
+    // move is a promotion, we have to convert it to our representation and in
+    // all other cases, we can directly compare with a Move after having masked
+    // out the special Move flags (bit 14-15) that are not supported by PolyGlot.
+    if (type_of(m) == PROMOTION)
+        return PMove((m & 0xFFF) | ((promotion_type(m) - 1) << 12));
+
+    return PMove(m & 0x3FFF);
+}
+
+/// OpeningTrie caches the opening lines of the games starting from the standard
+/// position: a node is reached by a sequence of SAN tokens and stores the move
+/// of the last token and the key of the resulting position. So a known prefix
+/// is indexed without resolving its moves. Nodes are taken from a fixed pool
+/// and linked with atomics, so that threads can search and grow the trie
+/// concurrently without locks. A node inserted twice by two threads is
+/// harmless, only the first one will be found.
+
+struct OpeningTrie {
+
+    static const int MaxPly = 20;
+
+    struct Node {
+        uint64_t san;
+        Key key;
+        Move move;
+        uint32_t sibling;
+        std::atomic<uint32_t> child;
+    };
+
+    // SAN is packed in 8 bytes, longer tokens are not cached and return 0
+    static uint64_t pack(const SanSpan& san) {
+        if (san.len > 8)
+            return 0;
+        uint64_t v = 0;
+        for (size_t i = 0; i < san.len; ++i)
+            v |= uint64_t(uint8_t(san.str[i])) << (8 * i);
+        return v;
+    }
+
+    void init(size_t mb, Key rootKey) {
+        size = mb * 1024 * 1024 / sizeof(Node);
+        nodes.reset(size ? new Node[size] : nullptr);
+        used = hits = 0;
+        if (size)
+            new_node(0, rootKey, MOVE_NONE);
+    }
+
+    // Returns the child of 'node' reached by 'san', or 0 (root) if not cached
+    uint32_t find(uint32_t node, uint64_t san) const {
+        uint32_t n = nodes[node].child.load(std::memory_order_acquire);
+        while (n && nodes[n].san != san)
+            n = nodes[n].sibling;
+        return n;
+    }
+
+    // Returns the new child of 'node', or 0 (root) if the pool is exhausted
+    uint32_t insert(uint32_t node, uint64_t san, Move m, Key k) {
+        uint32_t n = new_node(san, k, m);
+        if (!n)
+            return 0;
+
+        std::atomic<uint32_t>& head = nodes[node].child;
+        uint32_t first = head.load(std::memory_order_acquire);
+        do nodes[n].sibling = first;
+        while (!head.compare_exchange_weak(first, n, std::memory_order_release,
+                                                     std::memory_order_acquire));
+        return n;
+    }
+
+    uint32_t new_node(uint64_t san, Key k, Move m) {
+        size_t n = used++;
+        if (n >= size)
+            return 0;
+
+        nodes[n].san = san;
+        nodes[n].key = k;
+        nodes[n].move = m;
+        nodes[n].sibling = 0;
+        nodes[n].child = 0;
+        return uint32_t(n);
+    }
+
+    std::unique_ptr<Node[]> nodes;
+    size_t size = 0;
+    std::atomic<size_t> used;
+    std::atomic<uint64_t> hits; // Moves indexed out of the trie
+};
+
+OpeningTrie Openings;
+
+/// Arena is the per-thread working set of the parser: the SAN spans of the
+/// current game, pointing into the PGN text, and the StateInfo stack to play
+/// them. All grow on demand and are recycled across games. States are in a
+/// std::deque, that does not move them when growing, and nested parse_game()
+/// calls, like the replays of san_to_move(), take the states above the ones of
+/// the caller.
+
+struct Arena {
+
+    StateInfo* new_state() {
+        if (top == states.size())
+            states.emplace_back();
+        return &states[top++];
+    }
+
+    // A variation is the alternative to the main line move at index 'ply'. Its
+    // moves start at 'begin' in 'lines' and end with a ")" span, the nested
+    // variations are enclosed in "(" and ")" spans.
+    struct Variation {
+        size_t ply;
+        size_t begin;
+    };
+
+    std::vector<SanSpan> moves;
+    std::vector<SanSpan> lines;
+    std::vector<Variation> variations;
+    std::deque<StateInfo> states;
+    size_t top = 0;
+};
+
+thread_local Arena LocalArena;
+
+/// parse_variation() indexes the moves of a variation that branches off from
+/// 'root', up to its closing ")". At each nested "(" the position is saved on
+/// a stack and the nested line is played from the position before the last
+/// move. Moves are not fixed: a line is dropped from its first wrong move on,
+/// together with its nested variations.
+
+void parse_variation(const Position& root, const SanSpan* cur, const SanSpan* end,
+                     Keys& kTable, FixUps& fixUps, uint32_t learn) {
+
+    struct Snapshot {
+        Position pos, prev;
+        bool moved, dead;
+    };
+
+    Snapshot stack[MaxRavDepth];
+    int depth = 0;
+    Position pos = root, prev = root;
+    bool moved = false, dead = false;
+    bool strict = fixUps.strict;
+
+    fixUps.strict = true;
+
+    for ( ; cur < end; ++cur)
+    {
+        if (*cur->str == '(')
+        {
+            stack[depth++] = { pos, prev, moved, dead };
+            dead = dead || !moved;
+            pos = prev;
+            moved = false;
+        }
+        else if (*cur->str == ')')
+        {
+            if (!depth)
+                break;
+
+            const Snapshot& s = stack[--depth];
+            pos = s.pos, prev = s.prev, moved = s.moved, dead = s.dead;
+        }
+        else if (!dead)
+        {
+            Move move = pos.san_to_move(cur, cur + 1, fixUps);
+            if (move == MOVE_NONE)
+            {
+                dead = true;
+                continue;
+            }
+
+            prev = pos;
+            moved = true;
+
+            if (move == MOVE_NULL)
+                pos.do_null_move(*LocalArena.new_state());
+            else
+            {
+                kTable.push_back({pos.key(), to_polyglot(move), 1, learn | VariationFlag});
+                pos.do_move(move, *LocalArena.new_state());
+            }
+        }
+    }
+
+    fixUps.strict = strict;
+}
+
+template<bool DryRun = false>
+const SanSpan* parse_game(const SanSpan* moves, const SanSpan* end, Keys& kTable,
+                          const char* fen, const char* fenEnd, FixUps& fixUps,
+                          uint64_t gameId, int result) {
+
+    Arena& arena = LocalArena;
+    size_t top = arena.top; // States are released on return
+    Position pos = RootPos;
+    const SanSpan* cur = moves;
+    size_t gameStart = kTable.size();
+
+    if (fenEnd != fen)
+        pos.set(fen, false, arena.new_state());
+
+    if (!DryRun)
+        fixUps.memo.clear();
+
+    // Use Polyglot 'learn' parameter to store game result in the upper 2 bits,
+    // and game id in the lower 29 bits. Bit 29 is left for VariationFlag, set
+    // on the moves of the variations. The game table written next to the book
+    // maps the id to the exact offset and length of the game in the PGN file.
+    // Result is stored in the upper 2 bits so that sorting by 'learn' allows
+    // easy counting of result statistics.
+    const uint32_t learn =  ((uint32_t(result) & 3) << 30)
+                          | (gameId & GameIdMask);
+
+    // Variations are indexed when the main line reaches their branching point
+    const Arena::Variation* var = arena.variations.data();
+    const Arena::Variation* varEnd = DryRun ? var : var + arena.variations.size();
+
+    // Index the known opening prefix out of the trie, then set the position at
+    // the point of divergence, where the new moves will be added to the trie.
+    bool cache = !DryRun && fenEnd == fen && Openings.size;
+    uint32_t node = 0;
+    int ply = 0;
+
+    if (cache)
+    {
+        Move path[OpeningTrie::MaxPly];
+        uint32_t child;
+
+        while (   cur < end && ply < OpeningTrie::MaxPly
+               && (var == varEnd || size_t(cur - moves) < var->ply)
+               && (child = Openings.find(node, OpeningTrie::pack(*cur))) != 0)
+        {
+            const OpeningTrie::Node& n = Openings.nodes[child];
+            kTable.push_back({Openings.nodes[node].key, to_polyglot(n.move), 1, learn});
+            path[ply++] = n.move;
+            node = child;
+            ++cur;
+        }
+
+        if (ply)
+            Openings.hits += ply;
+
+        for (int i = 0; i < ply; ++i)
+            pos.do_move(path[i], *arena.new_state());
+    }
+
+    while (cur < end)
+    {
+        while (var != varEnd && var->ply == size_t(cur - moves))
+            parse_variation(pos, &arena.lines[var++->begin],
+                            arena.lines.data() + arena.lines.size(), kTable, fixUps, learn);
+
+        size_t fixed = fixUps.count;
+        Move move = pos.san_to_move(cur, end, fixUps);
+        if (move == MOVE_NONE)
+        {
+            if (!DryRun)
+            {
+                const char* sep = pos.side_to_move() == WHITE ? "" : "..";
+
+                if (!fixUps.quiet)
+                    std::cerr << "\nWrong move notation: " << sep << std::string(cur->str, cur->len)
+                              << "\n" << pos << std::endl;
+
+                // In strict mode the whole game is rejected
+                if (fixUps.strict)
+                {
+                    kTable.resize(gameStart);
+                    fixUps.rejected++;
+                }
+            }
+            arena.top = top;
+            return cur;
+        }
+        else if (move == MOVE_NULL)
+        {
+            pos.do_null_move(*arena.new_state());
+            cache = false;
+        }
+        else
+        {
+            if (!DryRun)
+                kTable.push_back({pos.key(), to_polyglot(move), 1, learn});
+
+            pos.do_move(move, *arena.new_state());
+
+            // Moves fixed out of the context of the game are not cached
+            if (cache && fixUps.count == fixed && ply < OpeningTrie::MaxPly)
+            {
+                uint64_t san = OpeningTrie::pack(*cur);
+                node = san ? Openings.insert(node, san, move, pos.key()) : 0;
+                cache = node != 0;
+                ply++;
+            }
+            else
+                cache = false;
+        }
+
+        ++cur;
+    }
+    arena.top = top;
+    return end;
+}
+
+int get_result(const char* data) {
+
+    // Result is coded from 0 to 3 as WHITE_WIN, BLACK_WIN, DRAW, RESULT_UNKNOWN.
+    // START_RESULT is triggered by '/', '*', '0', '-'.
+    switch (*data) {
+    case '/':
+        return 2;
+    case '0':
+        return 1;
+    case '-':
+        if (    *(data-1) == '1'
+            || (*(data-1) == ' ' && *(data-2) == '1')) // Like '1 - 0'
+            return 0;
+        else if (    *(data-1) == '0'
+                 || (*(data-1) == ' ' && *(data-2) == '0'))
+            return 1;
+        break;
+    default:
+        break;
+    }
+    return 3;
+}
+
+/// skip() returns the first character in [data, eof) that is in the stop list,
+/// or eof if none is found. Bulk of the scan is done 32 (AVX2) or 16 (SSE2)
+/// characters at a time, the remaining tail with a plain loop.
+
+const char* skip(const char* data, const char* eof, const StopChars& sc) {
+
+#if defined(USE_AVX2)
+    __m256i stops[4];
+
+    for (int i = 0; i < sc.count; ++i)
+        stops[i] = _mm256_set1_epi8(sc.chars[i]);
+
+    for ( ; data + 32 <= eof; data += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)data);
+        __m256i m = _mm256_cmpeq_epi8(v, stops[0]);
+
+        for (int i = 1; i < sc.count; ++i)
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, stops[i]));
+
+        if (uint32_t mask = uint32_t(_mm256_movemask_epi8(m)))
+            return data + lsb(mask);
+    }
+#elif defined(__SSE2__)
+    __m128i stops[4];
+
+    for (int i = 0; i < sc.count; ++i)
+        stops[i] = _mm_set1_epi8(sc.chars[i]);
+
+    for ( ; data + 16 <= eof; data += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)data);
+        __m128i m = _mm_cmpeq_epi8(v, stops[0]);
+
+        for (int i = 1; i < sc.count; ++i)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, stops[i]));
+
+        if (uint32_t mask = uint32_t(_mm_movemask_epi8(m)))
+            return data + lsb(mask);
+    }
+#endif
+
+    for ( ; data < eof; ++data)
+        for (int i = 0; i < sc.count; ++i)
+            if (*data == sc.chars[i])
+                return data;
+
+    return eof;
+}
+
+void parse_pgn(const char* baseAddress, uint64_t size, uint64_t baseOfs,
+               uint64_t gameBase, size_t slot, bool strict, bool variations, bool quiet,
+               Stats& stats, Keys& kTable, Runs& runs, std::vector<GameEntry>& games) {
+
+    Step (*steps)[TOKEN_NB] = variations ? ToStepRav : ToStep;
+    Step* stateStack[16];
+    Step**stateSp = stateStack;
+    int stmStack[MaxRavDepth], depth = 0; // Side to move before each variation
+    char fen[256], *fenEnd = fen;
+    std::vector<SanSpan>& moves = LocalArena.moves;
+    std::vector<SanSpan>& lines = LocalArena.lines;
+    const char* sanStart = nullptr;
+    size_t moveCnt = 0, ravCnt = 0, gameCnt = 0, gameRavs = 0;
+    FixUps fixUps;
+    fixUps.strict = strict;
+    fixUps.quiet = quiet;
+    uint64_t gameOfs = baseOfs;
+    int result = 3;
+    const char* data = baseAddress;
+    const char* eof = data + size;
+    int stm = WHITE;
+    Step* state = steps[HEADER];
+
+    // Moves are not copied, a SAN is the span of the PGN text up to 'data'
+    auto end_move = [&]() {
+        if (!depth)
+        {
+            moves.push_back({ sanStart, size_t(data - sanStart) });
+            moveCnt++;
+        }
+        else
+        {
+            lines.push_back({ sanStart, size_t(data - sanStart) });
+            ravCnt++;
+        }
+        state = steps[stm == WHITE ? NEXT_SAN : NEXT_MOVE];
+        stm ^= 1;
+    };
+
+    auto clear_moves = [&]() {
+        moves.clear();
+        lines.clear();
+        LocalArena.variations.clear();
+        gameRavs = ravCnt;
+    };
+
+    clear_moves();
+
+    // Index the moves and store the exact extent of the game, without the
+    // surrounding blank lines. A game rejected in strict mode is not counted
+    // and gets no id, as if it was not in the PGN.
+    auto add_game = [&](const char* gameEnd) {
+
+        size_t rejected = fixUps.rejected;
+
+        for ( ; depth; --depth) // Close the variations left open
+            lines.push_back({ ")", 1 });
+
+        parse_game(moves.data(), moves.data() + moves.size(), kTable, fen, fenEnd,
+                   fixUps, gameBase + gameCnt, result);
+
+        if (fixUps.rejected != rejected)
+        {
+            moveCnt -= moves.size();
+            ravCnt = gameRavs;
+            return;
+        }
+
+        const char* gameStart = baseAddress + (gameOfs - baseOfs);
+
+        while (gameStart < gameEnd && ToToken[*(const uint8_t*)gameStart] == T_SPACES)
+            ++gameStart;
+
+        while (gameEnd > gameStart && ToToken[*(const uint8_t*)(gameEnd - 1)] == T_SPACES)
+            --gameEnd;
+
+        games.push_back({ baseOfs + (gameStart - baseAddress), uint32_t(gameEnd - gameStart), 0 });
+        gameCnt++;
+    };
+
+    for (  ; data < eof; ++data)
+    {
+        Token tk = ToToken[*(const uint8_t*)data];
+
+        switch (state[tk])
+        {
+        case FAIL:
+            if (depth) // Like free text in a variation, skip the rest of it
+            {
+                state = steps[BROKEN_VARIATION];
+                break;
+            }
+            stats.error = error(state, data, eof);
+            return;
+
+        case CONTINUE:
+        {
+            // Fast forward to the next character that can change state
+            const StopChars& sc = ToStop[(state - steps[0]) / TOKEN_NB];
+            if (sc.count)
+                data = skip(data + 1, eof, sc) - 1;
+            break;
+        }
+
+        case GAME_START:
+            if (!strncmp(data-1, "[Event ", 7))
+            {
+                data -= 2;
+                gameOfs = baseOfs + (data + 1 - baseAddress); // Skip the ignored game
+                state = steps[HEADER];
+            }
+            break;
+
+        case OPEN_TAG:
+            *stateSp++ = state;
+            if (*(data + 1) == 'F' && !strncmp(data+1, "FEN \"", 5))
+            {
+                data += 5;
+                state = steps[FEN_TAG];
+            }
+            else if (   *(data + 1) == 'V'
+                     && !strncmp(data+1, "Variant ", 8)
+                     &&  strncmp(data+9, "\"Standard\"", 10))
+            {
+                --stateSp; // Pop state, we are inside brackets
+                state = steps[SKIP_GAME];
+            }
+            else
+                state = steps[TAG];
+            break;
+
+        case OPEN_BRACE_COMMENT:
+            if (state == steps[READ_SAN]) // Comment attached to the move
+                end_move();
+            *stateSp++ = state;
+            state = steps[BRACE_COMMENT];
+            break;
+
+        case READ_FEN:
+            if (fenEnd < fen + sizeof(fen) - 1) // Skip the tail of a bogus FEN
+                *fenEnd++ = *data;
+            break;
+
+        case CLOSE_FEN_TAG:
+            *fenEnd++ = 0; // Zero-terminating string
+            state = steps[TAG];
+            if (strstr(fen, " b "))
+                stm = BLACK;
+            break;
+
+        case OPEN_VARIATION:
+            *stateSp++ = state;
+            state = steps[VARIATION];
+            break;
+
+        case OPEN_RAV:
+            if (state == steps[NUMERIC_ANNOTATION_GLYPH]) // Like $1(
+                state = *(--stateSp);
+
+            if (state == steps[READ_SAN]) // Variation attached to the move
+                end_move();
+
+            *stateSp++ = state;
+
+            // A variation is an alternative to the last move, it is skipped
+            // when there is none or when nested too deep.
+            if ((!depth && moves.empty()) || depth == MaxRavDepth)
+            {
+                state = steps[VARIATION];
+                break;
+            }
+
+            if (!depth)
+                LocalArena.variations.push_back({ moves.size() - 1, lines.size() });
+            else
+                lines.push_back({ "(", 1 });
+
+            stmStack[depth++] = stm;
+            stm ^= 1;
+            state = steps[NEXT_SAN];
+            break;
+
+        case CLOSE_RAV:
+            if (state == steps[NUMERIC_ANNOTATION_GLYPH]) // Like $1)
+                state = *(--stateSp);
+
+            if (state == steps[READ_SAN])
+                end_move();
+
+            if (!depth) // Stray parenthesis
+                break;
+
+            lines.push_back({ ")", 1 });
+            stm = stmStack[--depth];
+            state = *(--stateSp);
+            break;
+
+        case START_NAG:
+            *stateSp++ = state;
+            state = steps[NUMERIC_ANNOTATION_GLYPH];
+            break;
+
+        case POP_STATE:
+            state = *(--stateSp);
+            break;
+
+        case START_MOVE_NUMBER:
+            state = steps[MOVE_NUMBER];
+            break;
+
+        case START_NEXT_SAN:
+            state = steps[NEXT_SAN];
+            break;
+
+        case CASTLE_OR_RESULT:
+            if (data[2] != '0')
+            {
+                assert (result == 3 || depth);
+
+                if (!depth) // Results inside variations are ignored
+                    result = get_result(data);
+                state = steps[RESULT];
+                continue;
+            }
+            /* Fall through */
+
+        case START_READ_SAN:
+            sanStart = data;
+            state = steps[READ_SAN];
+            break;
+
+        case END_MOVE:
+            end_move();
+            break;
+
+        case START_RESULT:
+            assert (result == 3 || depth);
+
+            if (!depth)
+                result = get_result(data);
+            state = steps[RESULT];
+            break;
+
+        case END_GAME:
+            if (*data != '\n' || depth) // Handle spaces in result, like 1/2 - 1/2
+            {
+                state = steps[RESULT];
+                break;
+            }
+            add_game(data);
+            if (kTable.size() >= runs.budget && !runs.spill(kTable, slot))
+                return;
+            result = 3;
+            gameOfs = baseOfs + (data - baseAddress) + 1; // Beginning of next game
+            clear_moves();
+            fenEnd = fen;
+            state = steps[HEADER];
+            stm = WHITE;
+            break;
+
+        case TAG_IN_BRACE:
+             // Special case of missed brace close. Detect beginning of next game
+             if (strncmp(data, "[Event ", 7))
+                 break;
+
+             /* Fall through */
+
+        case MISSING_RESULT: // Missing result, next game already started
+            add_game(data);
+            if (kTable.size() >= runs.budget && !runs.spill(kTable, slot))
+                return;
+            result = 3;
+            gameOfs = baseOfs + (data - baseAddress); // Beginning of next game
+            clear_moves();
+            fenEnd = fen;
+            state = steps[HEADER];
+            stm = WHITE;
+
+            // Drop the states left by the broken game, for instance when a
+            // brace comment was never closed.
+            stateSp = stateStack;
+            *stateSp++ = state; // Fast forward into a TAG
+            state = steps[TAG];
+            break;
+
+        default:
+            assert(false);
+            break;
+        }
+    }
+
+    // Force accounting of last game if still pending. Many reason for this to
+    // trigger: no newline at EOF, missing result, missing closing brace, etc.
+    if (state == steps[READ_SAN])
+        end_move();
+
+    if (state != steps[HEADER] && state != steps[SKIP_GAME] && !moves.empty())
+    {
+        add_game(eof);
+    }
+
+    stats.games = gameCnt;
+    stats.moves = moveCnt;
+    stats.variations = ravCnt;
+    stats.fixed = fixUps.count;
+    stats.fixTime = fixUps.time;
+    stats.rejected = fixUps.rejected;
+}
+
+/// boundary() checks whether the game whose '[Event ' tag follows the newline
+/// at 'ev' starts after a game terminated by a result. In this case returns the
+/// offset where parse_pgn() itself would start the new game, that is just after
+/// the newline that closes the result of the previous game, so that a chunk
+/// starting there yields exactly the same game offsets of a single pass over
+/// the whole file. Otherwise returns 0.
+
+uint64_t boundary(const char* data, const char* ev) {
+
+    const char* last = ev;
+
+    while (last > data && (*last == ' ' || *last == '\t' || *last == '\r' || *last == '\n'))
+        --last;
+
+    bool isResult =   *last == '*'
+                   || (last - data >= 2 && (   !strncmp(last - 2, "1-0", 3)
+                                            || !strncmp(last - 2, "0-1", 3)
+                                            || !strncmp(last - 2, "1/2", 3)));
+
+    return isResult ? std::find(last, ev + 1, '\n') - data + 1 : 0;
+}
+
+/// game_boundary() returns the offset of the first game boundary at or after
+/// 'ofs', or 'size' if none is found.
+
+uint64_t game_boundary(const char* data, uint64_t size, uint64_t ofs) {
+
+    const char* end = data + size;
+    const char* cur = data + ofs;
+
+    while ((cur = std::search(cur, end, EventTag, EventTag + 8)) != end)
+        if (uint64_t b = boundary(data, cur++))
+            return b;
+
+    return size;
+}
+
+/// last_game_boundary() returns the offset of the last game boundary in the
+/// given data, or 0 if none is found.
+
+uint64_t last_game_boundary(const char* data, uint64_t size) {
+
+    const char* end = data + size;
+    const char* ev;
+
+    while ((ev = std::find_end(data, end, EventTag, EventTag + 8)) != end)
+        if (uint64_t b = boundary(data, end = ev))
+            return b;
+
+    return 0;
+}
+
+/// parse() splits the PGN data in 'threads' chunks at game boundaries and runs
+/// an independent parse_pgn() on each of them. Per-thread results are then
+/// concatenated in file order, so that output does not depend on the number of
+/// threads. On errors parsing stops and the first one is set in the stats.
+
+void parse(const char* data, uint64_t size, uint64_t baseOfs, size_t threads,
+           bool strict, bool variations, bool quiet, Stats& stats, Keys& kTable,
+           Runs& runs, GameTable& gTable) {
+
+    std::vector<uint64_t> cuts = { 0 };
+
+    for (size_t i = 1; i < threads; ++i)
+        cuts.push_back(game_boundary(data, size, std::max(cuts.back(), i * size / threads)));
+
+    cuts.push_back(size);
+
+    std::vector<Keys> keys(threads);
+    std::vector<Stats> results(threads, Stats());
+    std::vector<std::vector<GameEntry>> games(threads);
+    std::vector<size_t> slots(threads, 0);
+    std::vector<std::thread> workers;
+
+    // Game ids of the first chunk are known, the others start from zero and are
+    // fixed once the number of games of the previous chunks is known.
+    for (size_t i = 1; i < threads; ++i)
+        slots[i] = runs.new_slot();
+
+    for (size_t i = 0; i < threads; ++i)
+        if (cuts[i] < cuts[i + 1])
+            workers.emplace_back([&, i]() {
+
+                Keys& k = threads > 1 ? keys[i] : kTable;
+                uint64_t len = cuts[i + 1] - cuts[i];
+
+                // Reserve enough capacity according to chunk size. This is a very
+                // crude estimation, mainly we assume key index to be of 2 times the
+                // size of the pgn file.
+                if (k.empty())
+                    k.reserve(std::min(2 * len / sizeof(PolyEntry), runs.budget));
+
+                parse_pgn(data + cuts[i], len, baseOfs + cuts[i], i ? 0 : gTable.count,
+                          slots[i], strict, variations, quiet, results[i], k, runs, games[i]);
+            });
+
+    for (std::thread& th : workers)
+        th.join();
+
+    for (const Stats& r : results)
+        if (!r.error.empty())
+        {
+            stats.error = r.error;
+            return;
+        }
+
+    if (!runs.error.empty())
+    {
+        stats.error = runs.error;
+        return;
+    }
+
+    if (threads > 1)
+    {
+        size_t entries = kTable.size();
+        for (const Keys& k : keys)
+            entries += k.size();
+
+        kTable.reserve(entries);
+    }
+
+    for (size_t i = 0; i < threads; ++i)
+    {
+        stats.games += results[i].games;
+        stats.moves += results[i].moves;
+        stats.fixed += results[i].fixed;
+        stats.fixTime += results[i].fixTime;
+        stats.rejected += results[i].rejected;
+        stats.variations += results[i].variations;
+
+        if (i)
+        {
+            runs.slotBase[slots[i]] = gTable.count;
+
+            for (PolyEntry& e : keys[i])
+                e.learn += uint32_t(gTable.count);
+        }
+
+        if (!gTable.append(games[i]))
+        {
+            stats.error = "Too many games, at most 2^29 can be indexed";
+            return;
+        }
+
+        std::vector<GameEntry>().swap(games[i]);
+
+        if (threads > 1)
+        {
+            // Entries can go in any run because sorting order is canonical
+            if (kTable.size() + keys[i].size() > runs.budget && !runs.spill(keys[i]))
+            {
+                stats.error = runs.error;
+                return;
+            }
+
+            kTable.insert(kTable.end(), keys[i].begin(), keys[i].end());
+            Keys().swap(keys[i]); // Release memory as soon as possible
+        }
+    }
+}
+
+/// parse_stream() feeds parse() from a pipe or from stdin, so that compressed
+/// archives can be indexed on the fly, like:
+///
+///   zcat games.pgn.gz | parser book -
+///
+/// Input is read in fixed size windows with double buffering: while a window
+/// is parsed the next one is read by a helper thread. Each window is parsed up
+/// to its last game boundary, the partial game left is carried over to the
+/// next window. Progress is called with the bytes parsed after each window.
+/// Returns the number of bytes parsed, stops at the first error.
+
+uint64_t parse_stream(FILE* f, size_t threads, bool strict, bool variations, bool quiet,
+                      Stats& stats, Keys& kTable, Runs& runs, GameTable& gTable,
+                      const std::function<void(uint64_t)>& progress) {
+
+    std::vector<char> buf[] = { std::vector<char>(StreamWindow), std::vector<char>(StreamWindow) };
+    size_t len = fread(buf[0].data(), 1, StreamWindow, f);
+    bool eof = len < StreamWindow;
+    uint64_t baseOfs = 0;
+    int cur = 0;
+
+    while (len)
+    {
+        std::vector<char>& data = buf[cur];
+        std::vector<char>& next = buf[cur ^ 1];
+        size_t cut = eof ? len : last_game_boundary(data.data(), len);
+
+        if (!cut) // A single game does not fit the window, make room for it
+        {
+            size_t request = data.size();
+            data.resize(2 * data.size());
+            size_t n = fread(data.data() + len, 1, request, f);
+            eof = n < request;
+            len += n;
+            continue;
+        }
+
+        size_t carry = len - cut, n = 0;
+        next.resize(std::max(next.size(), data.size()));
+        std::memcpy(next.data(), data.data() + cut, carry);
+
+        std::thread reader;
+        if (!eof)
+            reader = std::thread([&]() { n = fread(next.data() + carry, 1, next.size() - carry, f); });
+
+        parse(data.data(), cut, baseOfs, threads, strict, variations, quiet, stats, kTable,
+              runs, gTable);
+
+        if (reader.joinable())
+        {
+            reader.join();
+            eof = n < next.size() - carry;
+        }
+
+        if (!stats.error.empty())
+            break;
+
+        baseOfs += cut;
+        len = carry + n;
+        cur ^= 1;
+        progress(baseOfs);
+    }
+    return baseOfs;
+}
+
+} // namespace
+
+const SanSpan* play_game(const Position& pos, Move move, const SanSpan* cur,
+                         const SanSpan* end, FixUps& fixUps) {
+
+    // The replay shares the memo of the game but is not accounted
+    size_t fixed = fixUps.count;
+    int64_t time = fixUps.time;
+    Keys k;
+    StateInfo st;
+    Position p = pos;
+    p.do_move(move, st);
+    ++cur; // Move to next move in game
+    const SanSpan* last = cur < end ? parse_game<true>(cur, end, k, p.fen().c_str(),
+                                                       nullptr, fixUps, 0, 3) : cur;
+    fixUps.count = fixed;
+    fixUps.time = time;
+    return last;
+}
+
+namespace Parser {
+
+
+void init() {
 
     static StateInfo st;
     const char* startFEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
@@ -561,291 +1840,842 @@ void init() {
     ToStep[HEADER][T_ZERO        ] = START_RESULT;
     ToStep[HEADER][T_RESULT      ] = START_RESULT;
 
-    // STATE = TAG
+    // STATE = TAG
+    //
+    // Between brackets in header section, generic tag
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[TAG][i] = CONTINUE;
+
+    ToStep[TAG][T_RIGHT_BRACKET] = POP_STATE;
+
+    // STATE = FEN_TAG
+    //
+    // Special tag to set a position from a FEN string
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[FEN_TAG][i] = READ_FEN;
+
+    ToStep[FEN_TAG][T_QUOTES] = CLOSE_FEN_TAG;
+
+    // STATE = BRACE_COMMENT
+    //
+    // Comment in braces, can appear almost everywhere. Note that brace comments
+    // do not nest according to PGN standard.
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[BRACE_COMMENT][i] = CONTINUE;
+
+    ToStep[BRACE_COMMENT][T_RIGHT_BRACE ] = POP_STATE;
+    ToStep[BRACE_COMMENT][T_LEFT_BRACKET] = TAG_IN_BRACE; // Missed closing brace
+
+    // STATE = VARIATION
+    //
+    // For the moment variations are ignored
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[VARIATION][i] = CONTINUE;
+
+    ToStep[VARIATION][T_RIGHT_PARENTHESIS] = POP_STATE;
+    ToStep[VARIATION][T_LEFT_PARENTHESIS ] = OPEN_VARIATION; // Nested
+    ToStep[VARIATION][T_LEFT_BRACE       ] = OPEN_BRACE_COMMENT;
+
+    // STATE = NUMERIC_ANNOTATION_GLYPH
+    //
+    // Just read a single number
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[NUMERIC_ANNOTATION_GLYPH][i] = POP_STATE;
+
+    ToStep[NUMERIC_ANNOTATION_GLYPH][T_ZERO ] = CONTINUE;
+    ToStep[NUMERIC_ANNOTATION_GLYPH][T_DIGIT] = CONTINUE;
+
+    // STATE = NEXT_MOVE
+    //
+    // Check for the beginning of the next move number
+    for (int i = 0; i < TOKEN_NB; i++)
+        ToStep[NEXT_MOVE][i] = CONTINUE;
+
+    ToStep[NEXT_MOVE][T_LEFT_PARENTHESIS] = OPEN_VARIATION;
+    ToStep[NEXT_MOVE][T_LEFT_BRACE      ] = OPEN_BRACE_COMMENT;
+    ToStep[NEXT_MOVE][T_LEFT_BRACKET    ] = MISSING_RESULT;
+    ToStep[NEXT_MOVE][T_DOLLAR          ] = START_NAG;
+    ToStep[NEXT_MOVE][T_RESULT          ] = START_RESULT;
+    ToStep[NEXT_MOVE][T_ZERO            ] = START_RESULT;
+    ToStep[NEXT_MOVE][T_DOT             ] = FAIL;
+    ToStep[NEXT_MOVE][T_MOVE_HEAD       ] = FAIL;
+    ToStep[NEXT_MOVE][T_MINUS           ] = FAIL;
+    ToStep[NEXT_MOVE][T_DIGIT           ] = START_MOVE_NUMBER;
+
+    // STATE = MOVE_NUMBER
+    //
+    // Continue until a dot is found, to tolerate missing dots,
+    // stop at first space, then start NEXT_SAN that will handle
+    // head trailing spaces. We can alias with a result like 1-0 or 1/2-1/2
+    ToStep[MOVE_NUMBER][T_ZERO  ] = CONTINUE;
+    ToStep[MOVE_NUMBER][T_DIGIT ] = CONTINUE;
+    ToStep[MOVE_NUMBER][T_RESULT] = START_RESULT;
+    ToStep[MOVE_NUMBER][T_MINUS ] = START_RESULT;
+    ToStep[MOVE_NUMBER][T_SPACES] = START_NEXT_SAN;
+    ToStep[MOVE_NUMBER][T_DOT   ] = START_NEXT_SAN;
+
+    // STATE = NEXT_SAN
     //
-    // Between brackets in header section, generic tag
+    // Check for the beginning of the next move SAN
     for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[TAG][i] = CONTINUE;
+        ToStep[NEXT_SAN][i] = CONTINUE;
 
-    ToStep[TAG][T_RIGHT_BRACKET] = POP_STATE;
+    ToStep[NEXT_SAN][T_LEFT_PARENTHESIS] = OPEN_VARIATION;
+    ToStep[NEXT_SAN][T_LEFT_BRACE      ] = OPEN_BRACE_COMMENT;
+    ToStep[NEXT_SAN][T_LEFT_BRACKET    ] = MISSING_RESULT;
+    ToStep[NEXT_SAN][T_DOLLAR          ] = START_NAG;
+    ToStep[NEXT_SAN][T_RESULT          ] = START_RESULT;
+    ToStep[NEXT_SAN][T_ZERO            ] = CASTLE_OR_RESULT;  // 0-0 or 0-1
+    ToStep[NEXT_SAN][T_DOT             ] = CONTINUE;          // Like 4... exd5
+    ToStep[NEXT_SAN][T_DIGIT           ] = START_MOVE_NUMBER; // Same as above
+    ToStep[NEXT_SAN][T_MOVE_HEAD       ] = START_READ_SAN;
+    ToStep[NEXT_SAN][T_MINUS           ] = START_READ_SAN;    // Null move "--"
 
-    // STATE = FEN_TAG
+    // STATE = READ_SAN
     //
-    // Special tag to set a position from a FEN string
+    // Just skip a single move SAN until a space is reached
     for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[FEN_TAG][i] = READ_FEN;
+        ToStep[READ_SAN][i] = CONTINUE;
 
-    ToStep[FEN_TAG][T_QUOTES] = CLOSE_FEN_TAG;
+    ToStep[READ_SAN][T_SPACES    ] = END_MOVE;
+    ToStep[READ_SAN][T_LEFT_BRACE] = OPEN_BRACE_COMMENT;
 
-    // STATE = BRACE_COMMENT
+    // STATE = RESULT
     //
-    // Comment in braces, can appear almost everywhere. Note that brace comments
-    // do not nest according to PGN standard.
+    // Ignore anything until a space is reached
     for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[BRACE_COMMENT][i] = CONTINUE;
+        ToStep[RESULT][i] = CONTINUE;
 
-    ToStep[BRACE_COMMENT][T_RIGHT_BRACE ] = POP_STATE;
-    ToStep[BRACE_COMMENT][T_LEFT_BRACKET] = TAG_IN_BRACE; // Missed closing brace
+    ToStep[RESULT][T_SPACES] = END_GAME;
 
-    // STATE = VARIATION
+    // STATE = SKIP_GAME
     //
-    // For the moment variations are ignored
+    // Ignore anything until start of next game
     for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[VARIATION][i] = CONTINUE;
+        ToStep[SKIP_GAME][i] = CONTINUE;
 
-    ToStep[VARIATION][T_RIGHT_PARENTHESIS] = POP_STATE;
-    ToStep[VARIATION][T_LEFT_PARENTHESIS ] = OPEN_VARIATION; // Nested
-    ToStep[VARIATION][T_LEFT_BRACE       ] = OPEN_BRACE_COMMENT;
+    ToStep[SKIP_GAME][T_EVENT] = GAME_START;
 
-    // STATE = NUMERIC_ANNOTATION_GLYPH
+    // STATE = BROKEN_VARIATION
     //
-    // Just read a single number
+    // With the 'variations' option, a variation that can't be read, like one
+    // with free text, is skipped until the closing parenthesis.
     for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[NUMERIC_ANNOTATION_GLYPH][i] = POP_STATE;
+        ToStep[BROKEN_VARIATION][i] = CONTINUE;
 
-    ToStep[NUMERIC_ANNOTATION_GLYPH][T_ZERO ] = CONTINUE;
-    ToStep[NUMERIC_ANNOTATION_GLYPH][T_DIGIT] = CONTINUE;
+    ToStep[BROKEN_VARIATION][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStep[BROKEN_VARIATION][T_LEFT_PARENTHESIS ] = OPEN_VARIATION; // Nested
+    ToStep[BROKEN_VARIATION][T_LEFT_BRACE       ] = OPEN_BRACE_COMMENT;
+
+    // With the 'variations' option the moves inside parentheses are read like
+    // the ones of the main line, until the closing parenthesis.
+    std::memcpy(ToStepRav, ToStep, sizeof(ToStep));
+
+    ToStepRav[NEXT_MOVE][T_LEFT_PARENTHESIS] = OPEN_RAV;
+    ToStepRav[NEXT_SAN ][T_LEFT_PARENTHESIS] = OPEN_RAV;
+    ToStepRav[READ_SAN ][T_LEFT_PARENTHESIS] = OPEN_RAV;
+    ToStepRav[NUMERIC_ANNOTATION_GLYPH][T_LEFT_PARENTHESIS] = OPEN_RAV;
+
+    ToStepRav[NEXT_MOVE  ][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStepRav[MOVE_NUMBER][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStepRav[NEXT_SAN   ][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStepRav[READ_SAN   ][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStepRav[RESULT     ][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+    ToStepRav[NUMERIC_ANNOTATION_GLYPH][T_RIGHT_PARENTHESIS] = CLOSE_RAV;
+
+    // Collect stop characters for states where almost everything is CONTINUE
+    for (int i = 0; i < STATE_NB; i++)
+    {
+        StopChars sc = StopChars();
+
+        for (int c = 0; c < 256 && sc.count <= 4; c++)
+            if (   ToStep[i][ToToken[c]] != CONTINUE
+                || ToStepRav[i][ToToken[c]] != CONTINUE)
+            {
+                if (sc.count < 4)
+                    sc.chars[sc.count] = char(c);
+                sc.count++;
+            }
+
+        ToStop[i] = sc.count <= 4 ? sc : StopChars();
+    }
+}
+
+/// build_book() builds the book, or updates it, with the given options and
+/// returns the statistics of the PGN, or an error. With 'update' only the games
+/// appended to the PGN since the book was built, or last updated, are parsed,
+/// and their entries are merged into the book. Many PGN files can be indexed in
+/// the same book, or a PGN in memory. The progress callback, if any, is called
+/// with the bytes parsed so far and the bytes to parse, zero if unknown.
+
+BuildResult build_book(const BuildOptions& opts) {
+
+    Keys kTable;
+    Runs runs;
+    GameTable gTable;
+    PolyglotBook oldBook;
+    BuildResult res = BuildResult();
+    std::vector<std::string> pgnNames = opts.pgnNames;
+    std::string bookName = opts.bookName;
+    std::ostream nowhere(nullptr);
+    std::ostream& log = opts.quiet ? nowhere : std::cerr;
+    size_t threads = std::max(opts.threads, size_t(1));
+    bool update = opts.update, full = opts.full, summary = opts.summary;
+    bool strict = opts.strict, variations = opts.variations;
+    uint64_t total = opts.size;
+
+    // A PGN in memory is recorded as a stream in the game table
+    if (opts.data)
+        pgnNames = { "-" };
+
+    if (pgnNames.empty())
+        return res.error = "Missing PGN file name...", res;
+
+    // The book is named after the first PGN file
+    if (bookName.empty() && (opts.data || !is_mappable(pgnNames[0])))
+        bookName = "stdin.bin";
+
+    else if (bookName.empty())
+    {
+        size_t lastdot = pgnNames[0].find_last_of(".");
+        bookName = pgnNames[0].substr(0, lastdot) + ".bin";
+    }
+
+    for (const std::string& name : pgnNames)
+        if (update && (opts.data || !is_mappable(name)))
+            return res.error = "Update needs a PGN file, not a stream", res;
+
+        else if (!opts.data && is_mappable(name))
+            total += std::ifstream(name, std::ifstream::binary | std::ifstream::ate).tellg();
+
+    // Memory budget is in MB and is shared among the threads. The new games of
+    // an update are sorted in memory.
+    if (opts.memory && !update)
+        runs.budget = std::max(opts.memory * 1024 * 1024 / sizeof(PolyEntry) / threads, size_t(1));
+
+    runs.prefix = bookName;
+
+    // The book files may be mapped by a previous find, and they are going to be
+    // replaced, that Windows does not allow while they are mapped.
+    Book.close();
+
+    if (!gTable.open(bookName + ".games", update))
+        return res.error = "Missing, old or broken game table " + bookName
+                         + ".games, the book must be built again", res;
+
+    // The book is updated with the same options it was built with
+    if (update)
+    {
+        if (!(gTable.flags & BUILD_FULL) || !oldBook.open(bookName))
+            return res.error = "Only a book built with 'full' can be updated", res;
+
+        for (const GameTable::PgnFile& pf : gTable.files)
+            for (const std::string& name : pgnNames)
+                if (pf.name == name)
+                {
+                    uint64_t size = std::ifstream(name, std::ifstream::binary | std::ifstream::ate).tellg();
+
+                    if (pf.size > size)
+                        return res.error = name + " is shorter than when indexed", res;
+
+                    total -= pf.size;
+                }
+
+        full = true;
+        strict = gTable.flags & BUILD_STRICT;
+        variations = gTable.flags & BUILD_VARIATIONS;
+        summary = std::ifstream(bookName + ".sum").good();
+    }
+
+    gTable.flags = 0;
+
+    if (full)
+        gTable.flags |= BUILD_FULL;
+
+    if (strict)
+        gTable.flags |= BUILD_STRICT;
+
+    if (variations)
+        gTable.flags |= BUILD_VARIATIONS;
+
+    // With a progress callback the PGN is parsed in slices, reporting after each
+    // one. Slices end at a game boundary, so the book does not change.
+    auto parse_slices = [&](const char* data, uint64_t size, uint64_t baseOfs) {
+
+        uint64_t slice = opts.progress ? ProgressSlice : size;
+
+        for (uint64_t ofs = 0, end; ofs < size; ofs = end)
+        {
+            end = size - ofs > slice ? game_boundary(data, size, ofs + slice) : size;
+
+            parse(data + ofs, end - ofs, baseOfs + ofs, threads, strict, variations,
+                  opts.quiet, res.stats, kTable, runs, gTable);
+
+            if (!res.stats.error.empty())
+                return;
+
+            if (opts.progress)
+                opts.progress(res.parsed + end, total);
+        }
+    };
+
+    // On errors the game table of an update is restored, and the runs and the
+    // files written aside are removed.
+    auto fail = [&](const std::string& error) {
+        Openings.init(0, 0);
+        gTable.abort();
+        std::remove((bookName + ".tmp").c_str());
+        std::remove((bookName + ".tmp.sum").c_str());
+        res.error = error;
+        return res;
+    };
+
+    // Cache size is in MB, zero disables the opening trie
+    Openings.init(opts.cache, RootPos.key());
+
+    log << "\nProcessing...";
+
+    res.elapsed = now();
+
+    // Files are parsed one after the other, each one split among the threads.
+    // With an update the bytes already indexed of a known file are skipped.
+    for (const std::string& name : pgnNames)
+    {
+        GameTable::PgnFile& pf = gTable.add_file(name);
+        uint64_t mapping, size = 0;
+        void* baseAddress;
+
+        if (opts.data)
+        {
+            parse_slices(opts.data, opts.size, 0);
+            size = opts.size;
+        }
+        else if (!is_mappable(name))
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            FILE* f = name == "-" ? stdin : fopen(name.c_str(), "rb");
+            if (!f)
+                return fail("Could not open " + name);
+
+            size = parse_stream(f, threads, strict, variations, opts.quiet, res.stats, kTable,
+                                runs, gTable,
+                                [&](uint64_t n) { if (opts.progress) opts.progress(res.parsed + n, 0); });
+
+            if (f != stdin)
+                fclose(f);
+        }
+        else if (!map_file(name.c_str(), &baseAddress, &mapping, &size))
+            return fail("Could not mmap() " + name);
+
+        else
+        {
+            parse_slices((const char*)baseAddress + pf.size, size - pf.size, pf.size);
+
+            unmap_file(baseAddress, mapping);
+            size -= pf.size;
+        }
+
+        if (!res.stats.error.empty())
+            return fail(res.stats.error);
+
+        res.parsed += size;
+        pf.size += size;
+    }
+
+    res.elapsed = now() - res.elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+
+    res.cacheHits = Openings.hits;
+    Openings.init(0, 0);
+
+    // The book is written aside and then renamed, so that the old one is never
+    // truncated under a reader that has it mapped. An update reads it to merge.
+    std::string outName = bookName + ".tmp";
+    BookWriter writer(outName, full, summary);
+
+    if (update)
+    {
+        log << "done\nSorting...";
+
+        res.sortTime = now();
+
+        radix_sort(kTable, threads);
+
+        res.sortTime = now() - res.sortTime;
+
+        log << "done\nMerging into Polygot book...";
+
+        res.uniqueKeys = merge_book(oldBook, kTable, writer);
+    }
+    else if (runs.files.empty())
+    {
+        log << "done\nSorting...";
+
+        res.sortTime = now();
+
+        radix_sort(kTable, threads);
+
+        res.uniqueKeys = weight_keys(kTable, threads);
+
+        res.sortTime = now() - res.sortTime;
+
+        log << "done\nWriting Polygot book...";
+
+        writer.write(kTable.data(), kTable.data() + kTable.size());
+    }
+    else
+    {
+        if (!kTable.empty() && !runs.spill(kTable))
+            return writer.close(), fail(runs.error);
+
+        Keys().swap(kTable);
+
+        log << "done\nMerging " << runs.files.size() << " sorted runs into Polygot book...";
+
+        size_t uniqueKeys = 0;
+
+        if (!runs.merge(writer, uniqueKeys))
+            return writer.close(), fail(runs.error);
+
+        res.uniqueKeys = uniqueKeys;
+    }
+
+    res.bookSize = writer.close();
+
+    oldBook.close();
+
+    for (std::string ext : { "", ".sum" })
+    {
+        std::remove((bookName + ext).c_str());
+
+        if (std::ifstream(outName + ext).good())
+            std::rename((outName + ext).c_str(), (bookName + ext).c_str());
+    }
+
+    gTable.close(res.bookSize / SizeOfPolyEntry);
+
+    log << "done\n" << std::endl;
+
+    res.bookName = bookName;
+    return res;
+}
+
+/// build_book() parses the options of the 'book' and 'update' commands, builds
+/// the book and outputs the results in JSON format. Returns the statistics of
+/// the PGN. Files can also be given as glob patterns.
+
+Stats build_book(std::istringstream& is, bool update) {
+
+    BuildOptions opts;
+    std::string opt;
+
+    opts.update = update;
+
+    while (is >> opt)
+        if (opt == "full")
+            opts.full = true;
+
+        else if (opt == "threads")
+            is >> opts.threads;
+
+        else if (opt == "out")
+            is >> opts.bookName;
+
+        else if (opt == "memory")
+            is >> opts.memory;
+
+        else if (opt == "summary")
+            opts.summary = true;
+
+        else if (opt == "cache")
+            is >> opts.cache;
+
+        else if (opt == "strict")
+            opts.strict = true;
+
+        else if (opt == "variations")
+            opts.variations = true;
+
+        else
+            for (const std::string& name : glob_files(opt))
+                opts.pgnNames.push_back(name);
+
+    if (opts.pgnNames.empty())
+    {
+        std::cerr << "Missing PGN file name..." << std::endl;
+        exit(0);
+    }
+
+    BuildResult res = build_book(opts);
+    const Stats& stats = res.stats;
+
+    if (!res.error.empty())
+    {
+        std::cerr << res.error << std::endl;
+        exit(1);
+    }
+
+    // An update writes the moves of the old games too, one book entry for each
+    uint64_t allMoves = opts.update ? res.bookSize / SizeOfPolyEntry
+                                    : stats.moves + stats.variations;
+
+    // Output probing info in JSON format
+    std::string tab = "\n    ";
+    std::stringstream json;
+    json << "{"
+         << tab << "\"Games\": " << stats.games << ","
+         << tab << "\"Moves\": " << stats.moves << ","
+         << tab << "\"Variation moves\": " << stats.variations << ","
+         << tab << "\"Incorrect moves\": " << stats.fixed << ","
+         << tab << "\"Rejected games\": " << stats.rejected << ","
+         << tab << "\"Unique positions (%)\": " << (allMoves ? 100 * res.uniqueKeys / allMoves : 0) << ","
+         << tab << "\"Cache hit rate (%)\": " << (stats.moves ? 100 * res.cacheHits / stats.moves : 0) << ","
+         << tab << "\"Games/second\": " << 1000 * stats.games / res.elapsed << ","
+         << tab << "\"Moves/second\": " << 1000 * stats.moves / res.elapsed << ","
+         << tab << "\"MBytes/second\": " << float(res.parsed) / res.elapsed / 1000 << ","
+         << tab << "\"Size of index file (bytes)\": " << res.bookSize << ","
+         << tab << "\"Book file\": \"" << res.bookName << "\","
+         << tab << "\"Processing time (ms)\": " << res.elapsed << ","
+         << tab << "\"Fix-up time (ms)\": " << stats.fixTime / 1000 << ","
+         << tab << "\"Sorting time (ms)\": " << res.sortTime << "\n"
+         << "}";
+
+    std::cout << json.str() << std::endl;
+
+    return stats;
+}
+
+void make_book(std::istringstream& is) {
+    build_book(is);
+}
+
+void update_book(std::istringstream& is) {
+    build_book(is, true);
+}
+
+
+/// json_escape() escapes quotes and backslashes, as in Windows paths
+
+std::string json_escape(const std::string& s) {
+
+    std::string str;
+
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            str += '\\';
+
+        str += c;
+    }
+    return str;
+}
+
+std::string move_to_json(const BookMove& m, const PolyglotBook& book) {
+
+    const uint64_t* results = m.results;
+    const std::vector<GameEntry>& games = m.games;
+    std::string str("\"move\": \"" + UCI::move(Move(m.move), false) + "\", \"weight\": ");
+    str += std::to_string(m.weight);
+
+    // Note that this output will only make sense if the parser is run in full mode,
+    // if not, there will always be one game, one win, and 0 draws and 0 losses.
+    str +=  ", \"games\": "  + std::to_string(results[0] + results[1] + results[2] + results[3])
+          + ", \"wins\": "   + std::to_string(results[0])
+          + ", \"losses\": " + std::to_string(results[1])
+          + ", \"draws\": "  + std::to_string(results[2])
+          + ", \"pgn offsets\": [";
+
+    for (const GameEntry& g : games)
+        str += std::to_string(g.ofs) + ", ";
+
+    if (str[str.length() - 1] == ' ')
+    {
+        str.pop_back();
+        str.pop_back();
+    }
+
+    str += "]";
+
+    // Lengths are known only for books with a game table
+    if (book.has_games())
+    {
+        str += ", \"pgn lengths\": [";
+
+        for (const GameEntry& g : games)
+            str += std::to_string(g.len) + ", ";
+
+        if (str[str.length() - 1] == ' ')
+        {
+            str.pop_back();
+            str.pop_back();
+        }
+
+        str += "]";
+    }
+
+    // Files are listed only for books of many PGN files
+    if (book.pgn_files().size() > 1)
+    {
+        str += ", \"pgn files\": [";
+
+        for (const GameEntry& g : games)
+            str += "\"" + json_escape(book.pgn_files()[g.file]) + "\", ";
+
+        if (str[str.length() - 1] == ' ')
+        {
+            str.pop_back();
+            str.pop_back();
+        }
+
+        str += "]";
+    }
+
+    return str;
+}
+
+void probe_key(std::vector<BookMove>& moves, const PolyglotBook& book,
+               size_t idx, size_t limit, size_t skip) {
+
+    PolyEntry e = book[idx];
+    Key key = e.key;
+
+    do {
+        BookMove m = { e.move, e.weight, {}, {} };
+        size_t skip_counter = skip;
+        m.games.reserve(limit);
+
+        do {
+            if (!skip_counter && m.games.size() < limit)
+                m.games.push_back(book.game(e.learn));
+
+            if (skip_counter)
+                --skip_counter;
+
+            m.results[(e.learn >> 30) & 3]++;
+
+            if (++idx == book.size())
+                break;
 
-    // STATE = NEXT_MOVE
-    //
-    // Check for the beginning of the next move number
-    for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[NEXT_MOVE][i] = CONTINUE;
+            e = book[idx];
+        }
+        while (e.move == m.move && e.key == key);
 
-    ToStep[NEXT_MOVE][T_LEFT_PARENTHESIS] = OPEN_VARIATION;
-    ToStep[NEXT_MOVE][T_LEFT_BRACE      ] = OPEN_BRACE_COMMENT;
-    ToStep[NEXT_MOVE][T_LEFT_BRACKET    ] = MISSING_RESULT;
-    ToStep[NEXT_MOVE][T_DOLLAR          ] = START_NAG;
-    ToStep[NEXT_MOVE][T_RESULT          ] = START_RESULT;
-    ToStep[NEXT_MOVE][T_ZERO            ] = START_RESULT;
-    ToStep[NEXT_MOVE][T_DOT             ] = FAIL;
-    ToStep[NEXT_MOVE][T_MOVE_HEAD       ] = FAIL;
-    ToStep[NEXT_MOVE][T_MINUS           ] = FAIL;
-    ToStep[NEXT_MOVE][T_DIGIT           ] = START_MOVE_NUMBER;
+        moves.push_back(std::move(m));
 
-    // STATE = MOVE_NUMBER
-    //
-    // Continue until a dot is found, to tolerate missing dots,
-    // stop at first space, then start NEXT_SAN that will handle
-    // head trailing spaces. We can alias with a result like 1-0 or 1/2-1/2
-    ToStep[MOVE_NUMBER][T_ZERO  ] = CONTINUE;
-    ToStep[MOVE_NUMBER][T_DIGIT ] = CONTINUE;
-    ToStep[MOVE_NUMBER][T_RESULT] = START_RESULT;
-    ToStep[MOVE_NUMBER][T_MINUS ] = START_RESULT;
-    ToStep[MOVE_NUMBER][T_SPACES] = START_NEXT_SAN;
-    ToStep[MOVE_NUMBER][T_DOT   ] = START_NEXT_SAN;
+    } while (idx < book.size() && key == e.key);
+}
 
-    // STATE = NEXT_SAN
-    //
-    // Check for the beginning of the next move SAN
-    for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[NEXT_SAN][i] = CONTINUE;
+/// probe_summary() is probe_key() for books with a summary: results come from
+/// the summary records and only the requested window of book entries is read.
 
-    ToStep[NEXT_SAN][T_LEFT_PARENTHESIS] = OPEN_VARIATION;
-    ToStep[NEXT_SAN][T_LEFT_BRACE      ] = OPEN_BRACE_COMMENT;
-    ToStep[NEXT_SAN][T_LEFT_BRACKET    ] = MISSING_RESULT;
-    ToStep[NEXT_SAN][T_DOLLAR          ] = START_NAG;
-    ToStep[NEXT_SAN][T_RESULT          ] = START_RESULT;
-    ToStep[NEXT_SAN][T_ZERO            ] = CASTLE_OR_RESULT;  // 0-0 or 0-1
-    ToStep[NEXT_SAN][T_DOT             ] = CONTINUE;          // Like 4... exd5
-    ToStep[NEXT_SAN][T_DIGIT           ] = START_MOVE_NUMBER; // Same as above
-    ToStep[NEXT_SAN][T_MOVE_HEAD       ] = START_READ_SAN;
-    ToStep[NEXT_SAN][T_MINUS           ] = START_READ_SAN;    // Null move "--"
+void probe_summary(std::vector<BookMove>& moves, const PolyglotBook& book,
+                   size_t idx, size_t limit, size_t skip) {
 
-    // STATE = READ_SAN
-    //
-    // Just read a single move SAN until a space is reached
-    for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[READ_SAN][i] = READ_MOVE_CHAR;
+    Key key = book.summary(idx).key;
 
-    ToStep[READ_SAN][T_SPACES    ] = END_MOVE;
-    ToStep[READ_SAN][T_LEFT_BRACE] = OPEN_BRACE_COMMENT;
+    for ( ; idx < book.summary_size(); ++idx)
+    {
+        SumEntry s = book.summary(idx);
 
-    // STATE = RESULT
-    //
-    // Ignore anything until a space is reached
-    for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[RESULT][i] = CONTINUE;
+        if (s.key != key)
+            break;
 
-    ToStep[RESULT][T_SPACES] = END_GAME;
+        BookMove m = { s.move, s.weight, { s.results[0], s.results[1], s.results[2], s.results[3] }, {} };
+        uint64_t cnt = s.results[0] + s.results[1] + s.results[2] + s.results[3];
 
-    // STATE = SKIP_GAME
-    //
-    // Ignore anything until start of next game
-    for (int i = 0; i < TOKEN_NB; i++)
-        ToStep[SKIP_GAME][i] = CONTINUE;
+        for (uint64_t i = skip; i < cnt && i < skip + limit; ++i)
+            m.games.push_back(book.game(book[s.first + i].learn));
 
-    ToStep[SKIP_GAME][T_EVENT] = GAME_START;
+        moves.push_back(std::move(m));
+    }
 }
 
-void make_book(std::istringstream& is) {
+/// probe() returns the moves of the position with the given key, and a window
+/// of their games, 'limit' games after the first 'skip' of each move. The book
+/// is only read, so that many threads can probe it at once.
 
-    Keys kTable;
-    Stats stats;
-    uint64_t mapping, size;
-    void* baseAddress;
-    std::string bookName, opt;
+std::vector<BookMove> probe(const PolyglotBook& book, Key key, size_t limit, size_t skip) {
 
-    is >> bookName;
+    bool found = false;
+    size_t idx = book.probe(key, &found);
+    std::vector<BookMove> moves;
 
-    if (bookName.empty())
+    if (found && book.has_summary())
     {
-        std::cerr << "Missing PGN file name..." << std::endl;
-        exit(0);
+        idx = book.probe_summary(key, &found);
+        if (found)
+            probe_summary(moves, book, idx, limit, skip);
     }
+    else if (found)
+        probe_key(moves, book, idx, limit, skip);
 
-    is >> opt;
-    bool full = opt == "full";
-
-    map(bookName.c_str(), &baseAddress, &mapping, &size);
+    return moves;
+}
 
-    // Reserve enough capacity according to file size. This is a very crude
-    // estimation, mainly we assume key index to be of 2 times the size of
-    // the pgn file.
-    kTable.reserve(2 * size / sizeof(PolyEntry));
+/// probe() with many keys returns the moves of each one, like probe() for one
+/// key, in the same order. The keys are searched sorted, all at once, so that
+/// the searches of near keys share the book records they read, and while one
+/// search waits for a record from memory the others can go on.
 
-    std::cerr << "\nProcessing...";
+std::vector<std::vector<BookMove>> probe(const PolyglotBook& book, const std::vector<Key>& keys,
+                                         size_t limit, size_t skip) {
 
-    TimePoint elapsed = now();
+    size_t n = keys.size();
+    std::vector<std::vector<BookMove>> moves(n);
+    std::vector<size_t> order(n), idx(n);
+    std::vector<Key> sorted(n);
+    std::unique_ptr<bool[]> found(new bool[n]);
 
-    parse_pgn(baseAddress, size, stats, kTable);
+    for (size_t i = 0; i < n; ++i)
+        order[i] = i;
 
-    elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
 
-    unmap(baseAddress, mapping);
+    for (size_t i = 0; i < n; ++i)
+        sorted[i] = keys[order[i]];
 
-    std::cerr << "done\nSorting...";
+    // Every key of the book has its summary records, so that a book with a
+    // summary is searched only there, like probe() ends up doing.
+    if (book.has_summary())
+        book.probe_summary(sorted.data(), n, idx.data(), found.get());
+    else
+        book.probe(sorted.data(), n, idx.data(), found.get());
 
-    std::sort(kTable.begin(), kTable.end());
+    for (size_t i = 0; i < n; ++i)
+        if (i > 0 && sorted[i] == sorted[i - 1])
+            moves[order[i]] = moves[order[i - 1]];
 
-    size_t uniqueKeys = 1, last = 0;
-    for (size_t idx = 1; idx < kTable.size(); ++idx)
-        if (kTable[idx].key != kTable[idx - 1].key)
-        {
-            if (idx - last > 2)
-                idx = sort_by_frequency(kTable, last, idx);
+        else if (found[i] && book.has_summary())
+            probe_summary(moves[order[i]], book, idx[i], limit, skip);
 
-            last = idx;
-            uniqueKeys++;
-        }
+        else if (found[i])
+            probe_key(moves[order[i]], book, idx[i], limit, skip);
 
-    std::cerr << "done\nWriting Polygot book...";
+    return moves;
+}
 
-    size_t lastdot = bookName.find_last_of(".");
-    if (lastdot != std::string::npos)
-        bookName = bookName.substr(0, lastdot);
-    bookName += ".bin";
-    size_t bookSize = write_poly_file(kTable, bookName, full);
+/// find_json() returns the moves found for a position, with their games, in
+/// JSON format. The FEN string is omitted when empty, like for a position given
+/// by its key. Output is indented when 'pretty' is set, otherwise it is on a
+/// single line.
 
-    std::cerr << "done\n" << std::endl;
+std::string find_json(const PolyglotBook& book, const std::string& fen, Key key,
+                      const std::vector<BookMove>& moves, bool pretty) {
 
-    // Output probing info in JSON format
-    std::string tab = "\n    ";
+    std::string tab = pretty ? "\n    " : " ";
+    std::string first = pretty ? tab : "";
+    std::string open = pretty ? tab + "   {" + tab + "        " : "{";
+    std::string close = pretty ? tab + "   }" : "}";
     std::stringstream json;
-    json << "{"
-         << tab << "\"Games\": " << stats.games << ","
-         << tab << "\"Moves\": " << stats.moves << ","
-         << tab << "\"Incorrect moves\": " << stats.fixed << ","
-         << tab << "\"Unique positions (%)\": " << (stats.moves ? 100 * uniqueKeys / stats.moves : 0) << ","
-         << tab << "\"Games/second\": " << 1000 * stats.games / elapsed << ","
-         << tab << "\"Moves/second\": " << 1000 * stats.moves / elapsed << ","
-         << tab << "\"MBytes/second\": " << float(size) / elapsed / 1000 << ","
-         << tab << "\"Size of index file (bytes)\": " << bookSize << ","
-         << tab << "\"Book file\": \"" << bookName << "\","
-         << tab << "\"Processing time (ms)\": " << elapsed << "\n"
-         << "}";
+    json << "{" << first;
 
-    std::cout << json.str() << std::endl;
+    if (!fen.empty())
+        json << "\"fen\": \"" << fen << "\"," << tab;
+
+    json << "\"key\": " << key << ","
+         << tab << "\"moves\": [";
+
+    std::string comma;
+    for (const BookMove& m : moves)
+    {
+        json << comma << open << move_to_json(m, book) << close;
+        comma = pretty ? "," : ", ";
+    }
+
+    json << (pretty ? tab + "]\n}" : "]}");
+    return json.str();
 }
 
+/// find_json() for a position probes the book and returns the moves found
+/// with the position.
 
-void probe_key(std::vector<std::string>& json_moves, const std::string& fName,
-               size_t ofs, size_t limit, size_t skip) {
+std::string find_json(const PolyglotBook& book, const Position& pos, size_t limit,
+                      size_t skip, bool pretty) {
 
-    std::ifstream ifs(fName.c_str(), std::ifstream::in | std::ifstream::binary);
+    return find_json(book, pos.fen(), pos.key(), probe(book, pos.key(), limit, skip), pretty);
+}
 
-    if (!ifs.is_open())
-        return;
+/// json_value() reads a field of a flat JSON object, like a 'serve' request,
+/// returning the text of a string, unescaped, or of a number. Returns false if
+/// the field is missing.
 
-    ifs.seekg(ofs, std::ios_base::beg);
+bool json_value(const std::string& obj, const std::string& field, std::string& value) {
 
-    PolyEntry e;
-    read_entry(e, ifs);
-    Key key = e.key;
-    std::vector<uint64_t> pgn_ofs;
-    pgn_ofs.reserve(limit);
+    size_t pos = obj.find("\"" + field + "\"");
 
-    do {
-        PMove move = e.move;
-        std::string str("\"move\": \"" + UCI::move(Move(e.move), false) + "\", \"weight\": ");
-        str += std::to_string(e.weight);
-        uint64_t results[4] = {};
-        size_t skip_counter = skip;
+    if (pos == std::string::npos)
+        return false;
 
-        do {
-            if (!skip_counter && pgn_ofs.size() < limit)
-                pgn_ofs.push_back((e.learn & 0x3FFFFFFF) << 3);
+    pos = obj.find_first_not_of(" \t:", pos + field.size() + 2);
 
-            if (skip_counter)
-                --skip_counter;
+    if (pos == std::string::npos)
+        return false;
 
-            results[(e.learn >> 30) & 3]++;
-            read_entry(e, ifs);
-        }
-        while (e.move == move);
+    value.clear();
 
-        // Note that this output will only make sense if the parser is run in full mode,
-        // if not, there will always be one game, one win, and 0 draws and 0 losses.
-        str +=  ", \"games\": "  + std::to_string(results[0] + results[1] + results[2] + results[3])
-              + ", \"wins\": "   + std::to_string(results[0])
-              + ", \"losses\": " + std::to_string(results[1])
-              + ", \"draws\": "  + std::to_string(results[2])
-              + ", \"pgn offsets\": [";
+    if (obj[pos] != '"')
+    {
+        size_t end = obj.find_first_of(" \t,}", pos);
+        value = obj.substr(pos, end == std::string::npos ? end : end - pos);
+        return true;
+    }
 
-        for (auto v : pgn_ofs)
-            str += std::to_string(v) + ", ";
+    for (++pos; pos < obj.size() && obj[pos] != '"'; ++pos)
+        value += obj[pos] == '\\' && pos + 1 < obj.size() ? obj[++pos] : obj[pos];
 
-        if (str[str.length() - 1] == ' ')
-        {
-            str.pop_back();
-            str.pop_back();
-        }
+    return true;
+}
 
-        pgn_ofs.clear();
+/// valid_fen() checks the piece placement of a FEN string coming from a client,
+/// so that a malformed one can not crash the server: eight ranks of eight
+/// squares and one king per side.
 
-        str += "]";
+bool valid_fen(const std::string& fen) {
+
+    int ranks = 1, squares = 0, kings[2] = {};
+
+    for (char c : fen.substr(0, fen.find(' ')))
+        if (c == '/')
+        {
+            if (squares != 8)
+                return false;
 
-        json_moves.push_back(str);
+            ++ranks;
+            squares = 0;
+        }
+        else if (c >= '1' && c <= '8')
+            squares += c - '0';
 
-    } while (key == e.key);
+        else if (std::strchr("PNBRQKpnbrqk", c))
+        {
+            ++squares;
+            kings[0] += c == 'K';
+            kings[1] += c == 'k';
+        }
+        else
+            return false;
 
-    ifs.close();
+    return ranks == 8 && squares == 8 && kings[0] == 1 && kings[1] == 1;
 }
 
+/// find() is the 'find' command. With 'id <request id>' the output is a single
+/// line tagged with the id, and errors are reported in the output instead of
+/// exiting, so that a client can send many requests without waiting for each
+/// response and match them when they come.
+
 void find(std::istringstream& is) {
 
-    PolyglotBook book;
-    std::string bookName, token, fenStr;
+    std::string bookName, token, fenStr, id, error;
     size_t limit = 10, skip = 0;
     is >> bookName;
 
-    if (bookName.empty())
-    {
-        std::cerr << "Missing PGN file name..." << std::endl;
-        exit(0);
-    }
-
     while (is >> token)
         if (token == "limit")
         {
             is >> token;
             std::stringstream to_size_t(token);
             to_size_t >> limit;
-            if (limit > 3000 || limit < 1)
-            {
-                std::cerr << "limit must be between 1 and 3000" << std::endl;
-                exit(0);
-            }
         }
         else if (token == "skip")
         {
@@ -855,41 +2685,422 @@ void find(std::istringstream& is) {
             std::stringstream to_size_t(token);
             to_size_t >> skip;
         }
+        else if (token == "id")
+            is >> id;
         else
             fenStr += token + " ";
 
-    if (fenStr.empty())
+    if (bookName.empty())
+        error = "Missing PGN file name...";
+
+    else if (limit > 3000 || limit < 1)
+        error = "limit must be between 1 and 3000";
+
+    else if (fenStr.empty() || (!id.empty() && !valid_fen(fenStr)))
+        error = "Missing FEN string...";
+
+    std::string tag = id.empty() ? "" : "{\"id\": \"" + json_escape(id) + "\", ";
+
+    if (!error.empty() && id.empty())
     {
-        std::cerr << "Missing FEN string..." << std::endl;
+        std::cerr << error << std::endl;
         exit(0);
     }
+    else if (!error.empty())
+    {
+        std::cout << tag << "\"error\": \"" << error << "\"}" << std::endl;
+        return;
+    }
+
+    // A missing book must not look like a position without games
+    if (!Book.open(bookName) && !id.empty())
+    {
+        std::cout << tag << "\"error\": \"Could not open book\"}" << std::endl;
+        return;
+    }
 
+    // Do not touch RootPos, it is the start position of the games to index
     StateInfo st;
-    RootPos.set(fenStr, false, &st);
-    bool found = false;
-    size_t ofs = book.probe(RootPos.key(), bookName, &found);
-    std::vector<std::string> json_moves;
-    if (found)
-        probe_key(json_moves, bookName, ofs, limit, skip);
+    Position pos;
+    pos.set(fenStr, false, &st);
 
-    // Output probing info in JSON format
-    std::string tab = "\n    ";
-    std::string indent8 = "        ";
-    std::stringstream json;
-    json << "{"
-         << tab << "\"fen\": \"" << RootPos.fen() << "\","
-         << tab << "\"key\": " << RootPos.key() << ","
-         << tab << "\"moves\": [";
+    if (id.empty())
+        std::cout << find_json(Book, pos, limit, skip, true) << std::endl;
+    else
+        std::cout << tag << find_json(Book, pos, limit, skip, false).substr(1) << std::endl;
+}
 
-    std::string comma;
-    for (auto& m : json_moves)
+/// findbatch() is the 'findbatch <book file> [limit <n>] [skip <n>] <items>'
+/// command, where items are FEN strings or keys, in decimal or hex with '0x',
+/// separated by ';'. All the keys are probed at once, that is much faster than
+/// a 'find' for each one, and the output is a JSON array with the output of
+/// 'find' for each item on a line, in the same order, or an 'error' field.
+
+void findbatch(std::istringstream& is) {
+
+    std::string bookName, token, items, item;
+    size_t limit = 10, skip = 0;
+    is >> bookName;
+
+    while (is >> token)
+        if (token == "limit")
+            is >> limit;
+
+        else if (token == "skip")
+            is >> skip;
+        else
+        {
+            std::getline(is, items);
+            items = token + items;
+            break;
+        }
+
+    if (bookName.empty() || items.empty())
     {
-        json << comma << tab << "   {" << tab << indent8 << m << tab << "   }";
-        comma = ",";
+        std::cerr << "Missing book file name or positions..." << std::endl;
+        exit(0);
     }
 
-    json << tab << "]\n}";
-    std::cout << json.str() << std::endl;
+    if (limit > 3000 || limit < 1)
+    {
+        std::cerr << "limit must be between 1 and 3000" << std::endl;
+        exit(0);
+    }
+
+    std::vector<std::string> fens;
+    std::vector<Key> keys;
+    std::vector<bool> valid;
+    std::stringstream ss(items);
+
+    while (std::getline(ss, item, ';'))
+    {
+        size_t first = item.find_first_not_of(" \t");
+        size_t last = item.find_last_not_of(" \t");
+        item = first == std::string::npos ? "" : item.substr(first, last - first + 1);
+        char* end = nullptr;
+        Key key = 0;
+        bool ok;
+
+        if (item.empty())
+            continue;
+
+        if (item.find('/') != std::string::npos)
+        {
+            if ((ok = valid_fen(item)))
+            {
+                StateInfo st;
+                Position pos;
+                pos.set(item, false, &st);
+                item = pos.fen();
+                key = pos.key();
+            }
+        }
+        else
+        {
+            key = std::strtoull(item.c_str(), &end, 0);
+            ok = !*end && std::isdigit(item[0]);
+            item.clear();
+        }
+
+        fens.push_back(item);
+        keys.push_back(key);
+        valid.push_back(ok);
+    }
+
+    if (!Book.open(bookName))
+    {
+        std::cerr << "Could not open book " << bookName << std::endl;
+        exit(0);
+    }
+
+    std::vector<std::vector<BookMove>> moves = probe(Book, keys, limit, skip);
+
+    std::cout << "[";
+
+    for (size_t i = 0; i < keys.size(); ++i)
+        std::cout << (i ? ",\n" : "\n")
+                  << (valid[i] ? find_json(Book, fens[i], keys[i], moves[i], false)
+                               : "{\"error\": \"Invalid FEN string or key\"}");
+
+    std::cout << "\n]" << std::endl;
+}
+
+typedef std::map<std::string, std::unique_ptr<PolyglotBook>> Books;
+
+/// serve_request() answers a 'serve' request, a JSON object on a single line
+/// with the fields of 'find': "fen", and optionally "book", "limit" and "skip".
+/// The book can be omitted when only one is served.
+
+std::string serve_request(const std::string& req, const Books& books) {
+
+    std::string bookName, fen, value;
+    size_t limit = 10, skip = 0;
+
+    if (!json_value(req, "fen", fen) || !valid_fen(fen))
+        return "{\"error\": \"Missing or invalid FEN string\"}";
+
+    if (json_value(req, "limit", value))
+        limit = std::strtoull(value.c_str(), nullptr, 10);
+
+    if (json_value(req, "skip", value))
+        skip = std::strtoull(value.c_str(), nullptr, 10);
+
+    if (limit > 3000 || limit < 1)
+        return "{\"error\": \"limit must be between 1 and 3000\"}";
+
+    auto it = json_value(req, "book", bookName) ? books.find(bookName)
+            : books.size() == 1 ? books.begin() : books.end();
+
+    if (it == books.end())
+        return "{\"error\": \"Unknown book\"}";
+
+    StateInfo st;
+    Position pos;
+    pos.set(fen, false, &st);
+    return find_json(*it->second, pos, limit, skip, false);
+}
+
+/// serve() is the 'serve <socket> <book file>... [threads <number>]' command:
+/// the books are opened once and queries are answered on a Unix domain socket,
+/// one JSON request per line and one JSON response per line, in the same order.
+/// Clients are served at once by a pool of threads, sharing the mapped books.
+/// Each thread waits for requests on the connections it accepted, and answers
+/// the ones that have some, so that a thread serves many clients. It never
+/// returns.
+
+void serve(std::istringstream& is) {
+
+    std::string sockName, token;
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1U);
+    Books books;
+
+    is >> sockName;
+
+    while (is >> token)
+        if (token == "threads")
+        {
+            is >> threads;
+            threads = std::max(threads, size_t(1));
+        }
+        else
+        {
+            books[token].reset(new PolyglotBook);
+
+            if (!books[token]->open(token))
+            {
+                std::cerr << "Could not open " << token << std::endl;
+                exit(1);
+            }
+        }
+
+    if (books.empty())
+    {
+        std::cerr << "Missing socket or book file name..." << std::endl;
+        exit(0);
+    }
+
+    int fd = listen_socket(sockName);
+
+    if (fd < 0)
+    {
+        std::cerr << "Could not listen on " << sockName << std::endl;
+        exit(1);
+    }
+
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < threads; ++i)
+        workers.emplace_back([&]() {
+
+            struct Client {
+                int fd;
+                std::string in;  // Partial request, waiting for its newline
+                std::string out; // Responses not yet taken by the connection
+                bool closed;     // By the client, once the responses are written
+            };
+
+            std::vector<Client> clients;
+            std::vector<int> fds, events, ready;
+            char chunk[4096];
+
+            while (true)
+            {
+                fds.assign(1, fd);
+                events.assign(1, SOCKET_READ);
+
+                // A client that does not read its responses is not read either,
+                // and connections wait for room only to write pending responses.
+                for (const Client& c : clients)
+                {
+                    fds.push_back(c.fd);
+                    events.push_back(  (!c.closed && c.out.size() < MaxBacklog ? SOCKET_READ : 0)
+                                     | (c.out.empty() ? 0 : SOCKET_WRITE));
+                }
+
+                // Failures other than a signal would fail again, do not spin
+                if (poll_sockets(fds, events, ready) < 0)
+                {
+                    std::cerr << "Could not wait for requests: " << strerror(errno) << std::endl;
+                    break;
+                }
+
+                // The requests received at once are answered with one write, the
+                // part the connection does not take is written when it has room.
+                // A request longer than MaxRequestSize closes the connection.
+                for (size_t j = clients.size(); j-- > 0; )
+                {
+                    Client& c = clients[j];
+                    bool alive = true;
+
+                    if (ready[j + 1] & events[j + 1] & SOCKET_READ)
+                    {
+                        int64_t n = read_socket(c.fd, chunk, sizeof(chunk));
+                        c.closed = n < 0;
+
+                        if (n > 0)
+                        {
+                            c.in.append(chunk, size_t(n));
+                            size_t start = 0, end;
+
+                            while ((end = c.in.find('\n', start)) != std::string::npos)
+                            {
+                                c.out += serve_request(c.in.substr(start, end - start), books) + "\n";
+                                start = end + 1;
+                            }
+
+                            c.in.erase(0, start);
+                            alive = c.in.size() <= MaxRequestSize;
+                        }
+                    }
+
+                    if (alive && !c.out.empty())
+                    {
+                        int64_t n = write_socket(c.fd, c.out);
+                        alive = n >= 0;
+                        c.out.erase(0, size_t(std::max(n, int64_t(0))));
+                    }
+
+                    if (!alive || (c.closed && c.out.empty()))
+                    {
+                        close_socket(c.fd);
+                        clients.erase(clients.begin() + j);
+                    }
+                }
+
+                // Many threads can be woken up by a client, only one gets it
+                if (ready[0])
+                {
+                    int client = accept_socket(fd);
+
+                    if (client >= 0)
+                        clients.push_back({ client, std::string(), std::string(), false });
+                }
+            }
+
+            for (const Client& c : clients)
+                close_socket(c.fd);
+        });
+
+    std::cerr << "Serving " << books.size() << " books on " << sockName << std::endl;
+
+    for (std::thread& th : workers)
+        th.join();
+}
+
+void bench(std::istringstream& is) {
+
+    const std::vector<std::string> Fens = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        "rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1",
+        "rnbqkbnr/pppppppp/8/8/3P4/8/PPP1PPPP/RNBQKBNR b KQkq - 0 1",
+        "rnbqkbnr/pppppppp/8/8/2P5/8/PP1PPPPP/RNBQKBNR b KQkq - 0 1",
+        "rnbqkbnr/pppppppp/8/8/8/5N2/PPPPPPPP/RNBQKB1R b KQkq - 0 1",
+        "rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+        "rnbqkbnr/pp1ppppp/8/2p5/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+        "rnbqkbnr/pppp1ppp/4p3/8/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+        "rnbqkbnr/pp1ppppp/2p5/8/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2",
+        "rnbqkb1r/pppppppp/5n2/8/3P4/8/PPP1PPPP/RNBQKBNR w KQkq - 1 2",
+        "rnbqkbnr/ppp1pppp/8/3p4/2PP4/8/PP2PPPP/RNBQKBNR b KQkq - 0 2",
+        "r1bqkbnr/pppp1ppp/2n5/1B2p3/4P3/5N2/PPPP1PPP/RNBQK2R b KQkq - 3 3",
+        "rnbqkb1r/1p2pppp/p2p1n2/8/3NP3/2N5/PPP2PPP/R1BQKB1R w KQkq - 0 6",
+        "rnbqk2r/pppp1ppp/4pn2/8/1bPP4/2N5/PP2PPPP/R1BQKBNR w KQkq - 2 4"
+    };
+    const int ProbeRounds = 20;
+    const TimePoint MinTime = 3000; // The workload is repeated for stable numbers
+    const std::string bookName = "bench.bin";
+
+    std::string dir = "../pgn";
+    is >> dir;
+
+    std::vector<std::string> files = list_files(dir, ".pgn");
+
+    if (files.empty())
+    {
+        std::cerr << "No PGN files in " << dir << std::endl;
+        return;
+    }
+
+    Stats total = Stats();
+    uint64_t bytes = 0, probes = 0, rounds = 0;
+    TimePoint indexTime = 0, probeTime = 0;
+
+    // Silence the output of the commands, errors included
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    std::streambuf* err = std::cerr.rdbuf(nullptr);
+
+    for ( ; !rounds || indexTime + probeTime < MinTime; ++rounds)
+        for (const std::string& pgn : files)
+        {
+            std::ifstream ifs(pgn, std::ifstream::in | std::ifstream::binary | std::ifstream::ate);
+            uint64_t size = uint64_t(ifs.tellg());
+
+            for (std::string mode : { "", " full" })
+            {
+                std::istringstream ss(pgn + mode + " out " + bookName);
+                TimePoint elapsed = now();
+                Stats stats = build_book(ss);
+                indexTime += now() - elapsed;
+                total.games += stats.games;
+                total.moves += stats.moves;
+                bytes += size;
+            }
+
+            TimePoint elapsed = now();
+
+            for (int i = 0; i < ProbeRounds; ++i)
+                for (const std::string& fen : Fens)
+                {
+                    std::istringstream ss(bookName + " limit 10 " + fen);
+                    find(ss);
+                    probes++;
+                }
+
+            probeTime += now() - elapsed;
+        }
+
+    std::cout.rdbuf(out);
+    std::cerr.rdbuf(err);
+    std::cout.clear();
+    std::cerr.clear();
+
+    Book.close();
+    std::remove(bookName.c_str());
+    std::remove((bookName + ".games").c_str());
+
+    indexTime = std::max(indexTime, TimePoint(1)); // Avoid a 'divide by zero'
+    probeTime = std::max(probeTime, TimePoint(1));
+
+    std::cerr << "\n==========================="
+              << "\nRounds            : " << rounds
+              << "\nFiles indexed     : " << 2 * files.size() * rounds
+              << "\nGames             : " << total.games
+              << "\nMoves             : " << total.moves
+              << "\nIndexing time (ms): " << indexTime
+              << "\nGames/second      : " << 1000 * total.games / indexTime
+              << "\nMBytes/second     : " << float(bytes) / indexTime / 1000
+              << "\nProbes            : " << probes
+              << "\nProbing time (ms) : " << probeTime
+              << "\nProbes/second     : " << 1000 * probes / probeTime << std::endl;
 }
 
 }
@@ -0,0 +1,89 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2014 Marco Costalba, Joona Kiiski, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARSER_H_INCLUDED
+#define PARSER_H_INCLUDED
+
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "book.h"
+
+/// Stats are the counters of the games parsed to build a book
+
+struct Stats {
+  int64_t games;
+  int64_t moves;
+  int64_t fixed;
+  int64_t fixTime; // Microseconds
+  int64_t rejected;
+  int64_t variations; // Moves read from the variations
+  std::string error; // Why parsing stopped, like a malformed PGN
+};
+
+/// BookMove is a move found in the book for a position, with the results of
+/// all its games and the games in the window requested.
+
+struct BookMove {
+  PMove move;
+  uint16_t weight;
+  uint64_t results[4]; // Wins, losses, draws and unknown
+  std::vector<GameEntry> games;
+};
+
+/// BuildOptions are the options of a book build, the ones of the 'book' command.
+/// Instead of files, the PGN can be given in memory with 'data' and 'size'.
+
+struct BuildOptions {
+  std::vector<std::string> pgnNames;
+  std::string bookName; // Named after the first PGN file if empty
+  size_t threads = 1, memory = 0, cache = 16;
+  bool full = false, summary = false, strict = false, variations = false;
+  bool update = false;
+  bool quiet = false; // No messages on stderr
+  const char* data = nullptr;
+  uint64_t size = 0;
+  std::function<void(uint64_t, uint64_t)> progress; // Bytes parsed and to parse
+};
+
+/// BuildResult is the outcome of a book build. The error is empty on success.
+
+struct BuildResult {
+  Stats stats;
+  std::string error;
+  std::string bookName;
+  uint64_t parsed, uniqueKeys, cacheHits, bookSize;
+  TimePoint elapsed, sortTime;
+};
+
+namespace Parser {
+
+void init();
+BuildResult build_book(const BuildOptions& opts);
+Stats build_book(std::istringstream& is, bool update = false);
+std::vector<BookMove> probe(const PolyglotBook& book, Key key, size_t limit, size_t skip);
+std::vector<std::vector<BookMove>> probe(const PolyglotBook& book, const std::vector<Key>& keys,
+                                         size_t limit, size_t skip);
+bool valid_fen(const std::string& fen);
+
+} // namespace Parser
+
+#endif // #ifndef PARSER_H_INCLUDED
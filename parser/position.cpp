@@ -32,7 +32,7 @@
 
 #include "polyglot.cpp"
 
-const char* play_game(const Position& pos, Move move, const char* moves, const char* end);
+const SanSpan* play_game(const Position& pos, Move move, const SanSpan* moves, const SanSpan* end, FixUps& fixUps);
 
 using std::string;
 
@@ -326,6 +326,17 @@ void Position::set_check_info(StateInfo* si) const {
   si->checkSquares[ROOK]   = attacks_from<ROOK>(ksq);
   si->checkSquares[QUEEN]  = si->checkSquares[BISHOP] | si->checkSquares[ROOK];
   si->checkSquares[KING]   = 0;
+  si->checkInfoReady = true;
+}
+
+
+/// Position::update_check_info() computes checkers and check info of a state
+/// reached with the lazy do_move(). It is const because the state is a cache.
+
+void Position::update_check_info() const {
+
+  st->checkersBB = attackers_to(square<KING>(sideToMove)) & pieces(~sideToMove);
+  set_check_info(st);
 }
 
 
@@ -503,8 +514,11 @@ bool Position::legal(Move m) const {
       return type_of(m) == CASTLING || !(attackers_to(to_sq(m)) & pieces(~us));
 
   // A non-king move is legal if and only if it is not pinned or it
-  // is moving along the ray towards or away from the king.
-  return   !(pinned_pieces(us) & from)
+  // is moving along the ray towards or away from the king. Only a piece
+  // on a queen line from the king can be pinned: test it before pins are
+  // computed, they may be lazy.
+  return   !(PseudoAttacks[QUEEN][square<KING>(us)] & from)
+        || !(pinned_pieces(us) & from)
         ||  aligned(from, to_sq(m), square<KING>(us));
 }
 
@@ -592,7 +606,7 @@ bool Position::gives_check(Move m) const {
   Square to = to_sq(m);
 
   // Is there a direct check?
-  if (st->checkSquares[type_of(piece_on(from))] & to)
+  if (check_squares(type_of(piece_on(from))) & to)
       return true;
 
   // Is there a discovered check?
@@ -639,8 +653,10 @@ bool Position::gives_check(Move m) const {
 
 /// Position::do_move() makes a move, and saves all information necessary
 /// to a StateInfo object. The move is assumed to be legal. Pseudo-legal
-/// moves should be filtered out before this function is called.
+/// moves should be filtered out before this function is called. In the Lazy
+/// variant checkers and pins are left to update_check_info().
 
+template<bool Lazy>
 void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
 
   assert(is_ok(m));
@@ -785,17 +801,25 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   // Update the key with the final value
   st->key = k;
 
-  // Calculate checkers bitboard (if move gives check)
-  st->checkersBB = givesCheck ? attackers_to(square<KING>(them)) & pieces(us) : 0;
-
   sideToMove = ~sideToMove;
 
-  // Update king attacks used for fast check detection
-  set_check_info(st);
+  if (Lazy)
+      st->checkInfoReady = false;
+  else
+  {
+      // Calculate checkers bitboard (if move gives check)
+      st->checkersBB = givesCheck ? attackers_to(square<KING>(them)) & pieces(us) : 0;
+
+      // Update king attacks used for fast check detection
+      set_check_info(st);
+  }
 
   assert(pos_is_ok());
 }
 
+template void Position::do_move<true>(Move m, StateInfo& newSt, bool givesCheck);
+template void Position::do_move<false>(Move m, StateInfo& newSt, bool givesCheck);
+
 
 /// Position::undo_move() unmakes a move. When it returns, the position should
 /// be restored to exactly the same state as before the move was made.
@@ -888,6 +912,9 @@ void Position::do_null_move(StateInfo& newSt) {
   assert(!checkers());
   assert(&newSt != st);
 
+  if (!st->checkInfoReady) // Copied below
+      update_check_info();
+
   std::memcpy(&newSt, st, sizeof(StateInfo));
   newSt.previous = st;
   st = &newSt;
@@ -1050,35 +1077,206 @@ static inline Bitboard trimPawn(Bitboard target, const char* san, bool isCapture
   return target;
 }
 
-Move Position::san_to_move(const char* cur, const char* end, size_t& fixed) const {
+/// Position::san_to_move_fast() decodes the common SAN forms (Nf3, Nbd7, R1e2,
+/// Qxe5, e4, exd5, e8=Q, exd8=Q, O-O) without generating and printing moves:
+/// the origin square is found among our attackers of the destination square.
+/// It accepts only the notation that move_is_san() would produce for the same
+/// move and returns MOVE_NONE otherwise, leaving anything else (null moves,
+/// double disambiguation, wrong notation) to the generic path.
+
+Move Position::san_to_move_fast(const char* san, size_t len) const {
+
+  Color us = sideToMove;
+  PieceType promotion = NO_PIECE_TYPE;
+
+  if (san[0] == 'O' || san[0] == '0' || san[0] == 'o')
+  {
+      char c = san[0];
+      bool kingSide = len == 3 && san[1] == '-' && san[2] == c;
+
+      if (!kingSide && !(len == 5 && san[1] == '-' && san[2] == c && san[3] == '-' && san[4] == c))
+          return MOVE_NONE;
+
+      ExtMove moveList[2];
+      ExtMove* last = us == WHITE ? generate_castling_moves<WHITE, NON_EVASIONS, false>(*this, moveList)
+                                  : generate_castling_moves<BLACK, NON_EVASIONS, false>(*this, moveList);
+
+      for (ExtMove* m = moveList; m < last; ++m)
+          if ((to_sq(m->move) > from_sq(m->move)) == kingSide)
+              return m->move;
+
+      return MOVE_NONE;
+  }
+
+  if (len >= 4 && san[len - 2] == '=')
+  {
+      size_t idx = PieceToSAN.find(san[len - 1], 2);
+      if (idx < KNIGHT || idx > QUEEN)
+          return MOVE_NONE;
+
+      promotion = PieceType(idx);
+      len -= 2;
+  }
+
+  if (   len < 2
+      || san[len - 2] < 'a' || san[len - 2] > 'h'
+      || san[len - 1] < '1' || san[len - 1] > '8')
+      return MOVE_NONE;
+
+  Square to = make_square(File(san[len - 2] - 'a'), Rank(san[len - 1] - '1'));
+  bool isPromotion = relative_rank(us, to) == RANK_8;
+
+  if (san[0] >= 'a' && san[0] <= 'h')
+  {
+      if (isPromotion != (promotion != NO_PIECE_TYPE))
+          return MOVE_NONE;
+
+      // No pawn can reach its first rank, and the square behind would be off
+      // the board.
+      if (relative_rank(us, to) == RANK_1)
+          return MOVE_NONE;
+
+      Square from;
+
+      if (len == 2) // Push
+      {
+          if (!empty(to))
+              return MOVE_NONE;
+
+          from = to - pawn_push(us);
+
+          if (   empty(from)
+              && relative_rank(us, to) == RANK_4)
+              from -= pawn_push(us);
+
+          if (piece_on(from) != make_piece(us, PAWN))
+              return MOVE_NONE;
+      }
+      else if (len == 4 && san[1] == 'x') // Capture
+      {
+          File f = File(san[0] - 'a');
+
+          if (f != file_of(to) + 1 && f != file_of(to) - 1)
+              return MOVE_NONE;
+
+          from = make_square(f, rank_of(to - pawn_push(us)));
+
+          if (piece_on(from) != make_piece(us, PAWN))
+              return MOVE_NONE;
+
+          if (to == ep_square())
+              return legal(make<ENPASSANT>(from, to)) ? make<ENPASSANT>(from, to) : MOVE_NONE;
+
+          if (!(pieces(~us) & to))
+              return MOVE_NONE;
+      }
+      else
+          return MOVE_NONE;
+
+      Move m = isPromotion ? make<PROMOTION>(from, to, promotion) : make_move(from, to);
+      return legal(m) ? m : MOVE_NONE;
+  }
+
+  size_t idx = PieceToSAN.find(san[0], 2);
+  if (idx < KNIGHT || idx > KING || promotion != NO_PIECE_TYPE)
+      return MOVE_NONE;
+
+  PieceType pt = PieceType(idx);
+  Bitboard disambiguation = ~Bitboard(0);
+  bool hasFile = false, hasRank = false;
+  const char* s = san + 1;
+  const char* dest = san + len - 2;
+
+  if (s < dest && *s >= 'a' && *s <= 'h')
+  {
+      disambiguation &= file_bb(File(*s++ - 'a'));
+      hasFile = true;
+  }
+
+  if (s < dest && *s >= '1' && *s <= '8')
+  {
+      disambiguation &= rank_bb(Rank(*s++ - '1'));
+      hasRank = true;
+  }
+
+  bool isCapture = s < dest && *s == 'x';
+  s += isCapture;
+
+  // Double disambiguation goes to the slow path because move_is_san() matches
+  // it also against the shorter san of a move to the disambiguation square.
+  if (s != dest || (hasFile && hasRank))
+      return MOVE_NONE;
+
+  if (isCapture ? !(pieces(~us) & to) : !empty(to))
+      return MOVE_NONE;
+
+  Bitboard b = attackers_to(to) & pieces(us, pt), legals = 0;
+
+  while (b)
+  {
+      Square from = pop_lsb(&b);
+      if (legal(make_move(from, to)))
+          legals |= from;
+  }
+
+  b = legals & disambiguation;
+
+  if (!b || more_than_one(b))
+      return MOVE_NONE;
+
+  Square from = lsb(b);
+  Bitboard others = legals ^ from;
+
+  // Disambiguation must be the same move_is_san() computes
+  bool needFile = others && !(others & file_bb(from));
+  bool needRank = others && !needFile && !(others & rank_bb(from));
+
+  if (   (others && !needFile && !needRank)
+      || needFile != hasFile
+      || needRank != hasRank)
+      return MOVE_NONE;
+
+  return make_move(from, to);
+}
+
+Move Position::san_to_move(const SanSpan* cur, const SanSpan* end, FixUps& fixUps) const {
+
+  Move fast = san_to_move_fast(cur->str, cur->len);
+  if (fast != MOVE_NONE)
+      return fast;
+
+  // Generic path needs a zero terminated copy of the move, it is short enough
+  // to fit in the string local buffer.
+  string buf(cur->str, cur->len);
+  const char* san = buf.c_str();
 
   ExtMove moveList[MAX_MOVES];
   ExtMove* last;
   Color us = sideToMove;
 
-  bool isCapture = strchr(cur, 'x');
+  bool isCapture = strchr(san, 'x');
   Bitboard target = isCapture ? pieces(~us) : ~pieces();
 
-  switch (cur[0]) {
+  switch (san[0]) {
   case 'N':
-      last = generate_moves<KNIGHT, false>(*this, moveList, us, trim(target, cur));
+      last = generate_moves<KNIGHT, false>(*this, moveList, us, trim(target, san));
       break;
 
   case 'B':
-      last = generate_moves<BISHOP, false>(*this, moveList, us, trim(target, cur));
+      last = generate_moves<BISHOP, false>(*this, moveList, us, trim(target, san));
       break;
 
   case 'R':
-      last = generate_moves<ROOK , false>(*this, moveList, us, trim(target, cur));
+      last = generate_moves<ROOK , false>(*this, moveList, us, trim(target, san));
       break;
 
   case 'Q':
-      last = generate_moves<QUEEN, false>(*this, moveList, us, trim(target, cur));
+      last = generate_moves<QUEEN, false>(*this, moveList, us, trim(target, san));
       break;
 
   case 'K':
-        last = us == WHITE ? generate_king_moves<WHITE, NON_EVASIONS, false, false>(*this, moveList, trim(target, cur))
-                           : generate_king_moves<BLACK, NON_EVASIONS, false, false>(*this, moveList, trim(target, cur));
+        last = us == WHITE ? generate_king_moves<WHITE, NON_EVASIONS, false, false>(*this, moveList, trim(target, san))
+                           : generate_king_moves<BLACK, NON_EVASIONS, false, false>(*this, moveList, trim(target, san));
       break;
 
   case 'O':
@@ -1089,13 +1287,13 @@ Move Position::san_to_move(const char* cur, const char* end, size_t& fixed) cons
       break;
 
   case '-':
-      assert(!strcmp(cur, "--"));
+      assert(!strcmp(san, "--"));
       return MOVE_NULL;
 
   default:
-      assert(cur[0] >= 'a' && cur[0] <= 'h');
+      assert(san[0] >= 'a' && san[0] <= 'h');
 
-      target = trimPawn(target, cur, isCapture);
+      target = trimPawn(target, san, isCapture);
 
       if (isCapture)
           last = us == WHITE ? generate_pawn_moves<WHITE, CAPTURES>(*this, moveList, target)
@@ -1107,58 +1305,134 @@ Move Position::san_to_move(const char* cur, const char* end, size_t& fixed) cons
   }
 
   for (ExtMove* m = moveList; m < last; ++m)
-      if (move_is_san(m->move, cur) && legal(m->move))
+      if (move_is_san(m->move, san) && legal(m->move))
           return m->move;
 
-  static bool strict = false;
-
-  if (strict)
+  if (fixUps.strict)
       return MOVE_NONE;
 
-  fixed++;
+  fixUps.count++;
+
+  auto start = std::chrono::steady_clock::now();
+  Move move = fix_san(moveList, last, san, cur, end, fixUps);
+  fixUps.time += std::chrono::duration_cast<std::chrono::microseconds>
+                (std::chrono::steady_clock::now() - start).count();
+
+  if (move == MOVE_NONE)
+      fixUps.count--; // No able to fix...
+
+  return move;
+}
+
+
+/// Position::fix_san() is the slow path of san_to_move() for a move that does
+/// not match in strict mode.
+
+Move Position::fix_san(ExtMove* moveList, ExtMove* last, const char* san,
+                       const SanSpan* cur, const SanSpan* end, FixUps& fixUps) const {
 
   // Retry with disambiguation rule relaxed, this is slow path anyhow
   for (ExtMove* m = moveList; m < last; ++m)
-      if (move_is_san<false>(m->move, cur) && legal(m->move))
+      if (move_is_san<false>(m->move, san) && legal(m->move))
           return m->move;
 
   // If is a capture withouth 'x' or a non-capture with 'x' we may have missed
   // it, so regenerate move list to include all legal moves and retry.
   for (const ExtMove& m : MoveList<LEGAL>(*this))
-      if (move_is_san<false>(m.move, cur) || move_is_uci(m.move, cur))
+      if (move_is_san<false>(m.move, san) || move_is_uci(m.move, san))
           return m.move;
 
-  // Ok, still not fixed, let's try to deduce the move out of the context. Play
-  // the game with the generated moves and check if only one candidate is valid.
-  //
-  // First step is to compute for each move how many plies we can play before
-  // a wrong move occurs. This should be done in strict mode to avoid complex
-  // artifacts.
-  typedef std::pair<Move, const char*> C;
-  std::vector<C> candidates;
+  // Ok, still not fixed, let's try to deduce the move out of the context. The
+  // replay of the game to verify a candidate fixes also the next wrong moves,
+  // so the result is kept in the memo of the game.
+  for (const FixUps::Memo& e : fixUps.memo)
+      if (e.san == cur->str && e.key == key())
+          return e.move;
+
+  return san_from_context(moveList, last, cur, end, fixUps);
+}
+
+
+/// Position::san_from_context() deduces the move out of the context: it plays
+/// the game with each candidate move and picks the one that survives longest
+/// without a wrong move. This is done in strict mode to avoid complex artifacts.
+/// Candidates are played side by side, one ply at a time, so that the replay
+/// stops as soon as only one survives, or after a window of plies where the
+/// first survivor is taken.
+
+Move Position::san_from_context(ExtMove* moveList, ExtMove* last, const SanSpan* cur,
+                                const SanSpan* end, FixUps& fixUps) const {
+
+  const int Window = 40;
+
+  struct Replay {
+      Move move;
+      Position pos;
+      StateInfo st[2]; // Previous states are never used again
+  };
+
+  std::vector<Replay> replays(last - moveList);
+  std::vector<size_t> alive; // Indices of surviving replays, in move list order
 
-  strict = true;
   for (ExtMove* m = moveList; m < last; ++m)
       if (legal(m->move))
-          candidates.push_back(C{m->move, play_game(*this, m->move, cur, end)});
-  strict = false;
+      {
+          Replay& r = replays[alive.size()];
+          r.move = m->move;
+          r.pos = *this;
+          r.pos.do_move(m->move, r.st[0]);
+          alive.push_back(alive.size());
+      }
+
+  if (alive.empty())
+      return MOVE_NONE;
 
-  // Then we pick the move that survived the longest
-  auto it = std::max_element(candidates.begin(), candidates.end(),
-                            [cur](const C& a, const C& b) -> bool
-                            {
-                                return a.second - cur < b.second - cur;
-                            });
+  const SanSpan* next = cur + 1; // Move to next move in game
+
+  fixUps.strict = true;
+
+  for (int ply = 1; alive.size() > 1 && next < end && ply <= Window; ++ply)
+  {
+      size_t survivors = 0;
+
+      for (size_t idx : alive)
+      {
+          Replay& r = replays[idx];
+          Move m = r.pos.san_to_move(next, end, fixUps);
+
+          if (m == MOVE_NONE)
+              continue;
+
+          if (m == MOVE_NULL)
+              r.pos.do_null_move(r.st[ply & 1]);
+          else
+              r.pos.do_move(m, r.st[ply & 1]);
+
+          alive[survivors++] = idx;
+      }
+
+      if (!survivors) // All fail on the same move, first one is the longest
+          break;
+
+      alive.resize(survivors);
+      ++next;
+  }
+
+  fixUps.strict = false;
 
   // If the best move is correct until the end we have finished, otherwise
   // replay the game with relaxed checks.
-  if (    candidates.size()
-      && (it->second == end || play_game(*this, it->first, cur, end) == end))
-      return it->first;
+  Move best = replays[alive[0]].move;
+
+  if (next < end && play_game(*this, best, cur, end, fixUps) != end)
+      best = MOVE_NONE;
 
-  fixed--; // No able to fix...
+  // Ties are broken by the move list order, that depends on the history of the
+  // position and not only on its key, so only a single survivor is memoized.
+  if (alive.size() == 1)
+      fixUps.memo.push_back({cur->str, key(), best});
 
-  return MOVE_NONE;
+  return best;
 }
 
 
@@ -26,11 +26,14 @@
 #include <deque>
 #include <memory> // For std::unique_ptr
 #include <string>
+#include <vector>
 
 #include "bitboard.h"
 #include "types.h"
 
 
+struct ExtMove;
+
 /// StateInfo struct stores information needed to restore a Position object to
 /// its previous state when we retract a move. Whenever a move is made on the
 /// board (by calling Position::do_move), a StateInfo object must be passed.
@@ -53,12 +56,46 @@ struct StateInfo {
   Bitboard   blockersForKing[COLOR_NB];
   Bitboard   pinnersForKing[COLOR_NB];
   Bitboard   checkSquares[PIECE_TYPE_NB];
+  bool       checkInfoReady; // Check info above is computed lazily when false
 };
 
 // In a std::deque references to elements are unaffected upon resizing
 typedef std::unique_ptr<std::deque<StateInfo>> StateListPtr;
 
 
+/// SanSpan is a move of the game as read from the PGN: it points straight into
+/// the file text and is not zero terminated.
+
+struct SanSpan {
+  const char* str;
+  size_t len;
+};
+
+
+/// FixUps is the state of san_to_move() for the moves with a wrong notation of
+/// a game: the count of fixed moves, the time spent to fix them, in
+/// microseconds, and the moves already deduced from the context of the game,
+/// that is the same for all the fix-ups of the game. The memo must be cleared
+/// when a new game is started. In strict mode wrong moves are not fixed at all
+/// and the games with a wrong move are rejected.
+
+struct FixUps {
+
+  struct Memo {
+    const char* san;
+    Key key;
+    Move move;
+  };
+
+  bool strict = false;
+  bool quiet = false; // Wrong moves are not logged
+  size_t count = 0;
+  size_t rejected = 0;
+  int64_t time = 0;
+  std::vector<Memo> memo;
+};
+
+
 /// Position class stores information regarding the board representation as
 /// pieces, side to move, hash keys, castling info, etc. Important methods are
 /// do_move() and undo_move(), used by the search to update node info when
@@ -129,6 +166,7 @@ public:
 
   // Doing and undoing moves
   void do_move(Move m, StateInfo& st, bool givesCheck);
+  void do_move(Move m, StateInfo& st);
   void undo_move(Move m);
   void do_null_move(StateInfo& st);
   void undo_null_move();
@@ -150,7 +188,7 @@ public:
   bool is_draw() const;
   bool move_is_uci(Move m, const char* ref) const;
   template<bool Strict = true> bool move_is_san(Move m, const char* ref) const;
-  Move san_to_move(const char* cur, const char* end, size_t& fixed) const;
+  Move san_to_move(const SanSpan* cur, const SanSpan* end, FixUps& fixUps) const;
 
   // Position consistency check, for debugging
   bool pos_is_ok(int* failedStep = nullptr) const;
@@ -161,8 +199,14 @@ private:
   void set_castling_right(Color c, Square rfrom);
   void set_state(StateInfo* si) const;
   void set_check_info(StateInfo* si) const;
+  void update_check_info() const;
 
   // Other helpers
+  template<bool Lazy>
+  void do_move(Move m, StateInfo& newSt, bool givesCheck);
+  Move san_to_move_fast(const char* san, size_t len) const;
+  Move fix_san(ExtMove* moveList, ExtMove* last, const char* san, const SanSpan* cur, const SanSpan* end, FixUps& fixUps) const;
+  Move san_from_context(ExtMove* moveList, ExtMove* last, const SanSpan* cur, const SanSpan* end, FixUps& fixUps) const;
   void put_piece(Piece pc, Square s);
   void remove_piece(Piece pc, Square s);
   void move_piece(Piece pc, Square from, Square to);
@@ -281,18 +325,26 @@ inline Bitboard Position::attackers_to(Square s) const {
 }
 
 inline Bitboard Position::checkers() const {
+  if (!st->checkInfoReady)
+      update_check_info();
   return st->checkersBB;
 }
 
 inline Bitboard Position::discovered_check_candidates() const {
+  if (!st->checkInfoReady)
+      update_check_info();
   return st->blockersForKing[~sideToMove] & pieces(sideToMove);
 }
 
 inline Bitboard Position::pinned_pieces(Color c) const {
+  if (!st->checkInfoReady)
+      update_check_info();
   return st->blockersForKing[c] & pieces(c);
 }
 
 inline Bitboard Position::check_squares(PieceType pt) const {
+  if (!st->checkInfoReady)
+      update_check_info();
   return st->checkSquares[pt];
 }
 
@@ -350,6 +402,18 @@ inline Piece Position::captured_piece() const {
   return st->capturedPiece;
 }
 
+/// Position::do_move() with the 'givesCheck' hint updates all the check info
+/// eagerly, as the search does. Without it the check info is computed only if
+/// and when it is needed, that is seldom when indexing a game.
+
+inline void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
+  do_move<false>(m, newSt, givesCheck);
+}
+
+inline void Position::do_move(Move m, StateInfo& newSt) {
+  do_move<true>(m, newSt, false);
+}
+
 inline void Position::put_piece(Piece pc, Square s) {
 
   board[s] = pc;
@@ -0,0 +1,421 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2016 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// CPython extension module 'chess_db_native', to build and probe books in the
+// same process of a Python program, without the pipe and the JSON of the
+// 'parser' executable. Build it with 'make python ARCH=<arch>'.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "bitboard.h"
+#include "book.h"
+#include "misc.h"
+#include "parser.h"
+#include "position.h"
+#include "uci.h"
+
+namespace {
+
+std::mutex BuildMutex; // Builds share the tables of the parser, one at a time
+std::mutex BooksMutex;
+std::map<std::string, std::shared_ptr<PolyglotBook>> Books; // Opened by find()
+
+/// open_book() returns the book with the given name, that is mapped once and
+/// then shared by all the threads. A book rebuilt since then is mapped again,
+/// the threads still probing the old one keep it. Returns nullptr if it can not
+/// be opened.
+
+std::shared_ptr<PolyglotBook> open_book(const std::string& name) {
+
+    std::lock_guard<std::mutex> lk(BooksMutex);
+
+    auto it = Books.find(name);
+
+    if (it != Books.end() && it->second->up_to_date())
+        return it->second;
+
+    std::shared_ptr<PolyglotBook> book = std::make_shared<PolyglotBook>();
+
+    if (!book->open(name))
+        return nullptr;
+
+    Books[name] = book;
+    return book;
+}
+
+/// to_strings() converts a string, or a sequence of strings, to a vector.
+/// Returns false, with the Python error set, on a wrong type.
+
+bool to_strings(PyObject* obj, std::vector<std::string>& v) {
+
+    if (PyUnicode_Check(obj))
+    {
+        v.push_back(PyUnicode_AsUTF8(obj));
+        return true;
+    }
+
+    PyObject* seq = PySequence_Fast(obj, "expected a string or a sequence of strings");
+
+    if (!seq)
+        return false;
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i)
+    {
+        const char* s = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+
+        if (!s)
+        {
+            Py_DECREF(seq);
+            return false;
+        }
+        v.push_back(s);
+    }
+
+    Py_DECREF(seq);
+    return true;
+}
+
+/// to_numbers() converts a sequence of integers to a vector
+template<typename T>
+bool to_numbers(PyObject* obj, std::vector<T>& v) {
+
+    PyObject* seq = PySequence_Fast(obj, "expected a sequence of integers");
+
+    if (!seq)
+        return false;
+
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i)
+    {
+        unsigned long long n = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+
+        if (PyErr_Occurred())
+        {
+            Py_DECREF(seq);
+            return false;
+        }
+        v.push_back(T(n));
+    }
+
+    Py_DECREF(seq);
+    return true;
+}
+
+/// set_item() adds a value to a dict, stealing the reference
+void set_item(PyObject* dict, const char* key, PyObject* value) {
+
+    PyDict_SetItemString(dict, key, value);
+    Py_DECREF(value);
+}
+
+/// make_book(pgn, book=None, full=True, threads=1, summary=False, strict=False,
+/// variations=False, update=False) builds, or updates, a book out of a PGN
+/// file or a list of them, as the 'book' command does, and returns the counters
+/// of the games parsed.
+
+PyObject* make_book(PyObject*, PyObject* args, PyObject* kwargs) {
+
+    const char* kwlist[] = { "pgn", "book", "full", "threads", "summary", "strict",
+                             "variations", "update", nullptr };
+    PyObject* pgn;
+    const char* bookName = nullptr;
+    int full = 1, threads = 1, summary = 0, strict = 0, variations = 0, update = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|zpipppp", const_cast<char**>(kwlist), &pgn,
+                                     &bookName, &full, &threads, &summary, &strict,
+                                     &variations, &update))
+        return nullptr;
+
+    BuildOptions opts;
+    std::vector<std::string> names;
+
+    if (!to_strings(pgn, names))
+        return nullptr;
+
+    for (const std::string& name : names)
+        for (const std::string& f : glob_files(name))
+            if (std::ifstream(f).good())
+                opts.pgnNames.push_back(f);
+            else
+            {
+                PyErr_SetString(PyExc_FileNotFoundError, f.c_str());
+                return nullptr;
+            }
+
+    if (opts.pgnNames.empty())
+    {
+        PyErr_SetString(PyExc_ValueError, "missing PGN file name");
+        return nullptr;
+    }
+
+    const std::string& first = opts.pgnNames[0];
+    opts.bookName = bookName ? bookName : first.substr(0, first.find_last_of(".")) + ".bin";
+    opts.threads = size_t(std::max(threads, 1));
+    opts.full = full;
+    opts.summary = summary;
+    opts.strict = strict;
+    opts.variations = variations;
+    opts.update = update;
+    opts.quiet = true;
+
+    BuildResult res;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    std::lock_guard<std::mutex> lk(BuildMutex);
+
+    // The book is going to be rewritten, next find() maps it again
+    {
+        std::lock_guard<std::mutex> lkb(BooksMutex);
+        Books.erase(opts.bookName);
+    }
+
+    res = Parser::build_book(opts);
+
+    {
+        std::lock_guard<std::mutex> lkb(BooksMutex);
+        Books.erase(res.bookName);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (!res.error.empty())
+    {
+        PyErr_SetString(PyExc_RuntimeError, res.error.c_str());
+        return nullptr;
+    }
+
+    const Stats& stats = res.stats;
+    PyObject* result = PyDict_New();
+    set_item(result, "games", PyLong_FromLongLong(stats.games));
+    set_item(result, "moves", PyLong_FromLongLong(stats.moves));
+    set_item(result, "variations", PyLong_FromLongLong(stats.variations));
+    set_item(result, "fixed", PyLong_FromLongLong(stats.fixed));
+    set_item(result, "rejected", PyLong_FromLongLong(stats.rejected));
+    set_item(result, "book", PyUnicode_FromString(res.bookName.c_str()));
+    return result;
+}
+
+/// find(book, fen, limit=10, skip=0) returns the moves of the position with
+/// their results and games, as a dict with the same fields of the output of
+/// the 'find' command. The book is mapped at the first call and kept mapped.
+
+PyObject* find(PyObject*, PyObject* args, PyObject* kwargs) {
+
+    const char* kwlist[] = { "book", "fen", "limit", "skip", nullptr };
+    const char* bookName;
+    const char* fen;
+    unsigned long long limit = 10, skip = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|KK", const_cast<char**>(kwlist), &bookName,
+                                     &fen, &limit, &skip))
+        return nullptr;
+
+    if (limit > 3000 || limit < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "limit must be between 1 and 3000");
+        return nullptr;
+    }
+
+    if (!Parser::valid_fen(fen))
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid FEN string");
+        return nullptr;
+    }
+
+    std::shared_ptr<PolyglotBook> book;
+    std::vector<BookMove> moves;
+    std::string fenStr;
+    Key key = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    book = open_book(bookName);
+
+    if (book)
+    {
+        StateInfo st;
+        Position pos;
+        pos.set(fen, false, &st);
+        key = pos.key();
+        fenStr = pos.fen();
+        moves = Parser::probe(*book, key, size_t(limit), size_t(skip));
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (!book)
+    {
+        PyErr_SetString(PyExc_FileNotFoundError, bookName);
+        return nullptr;
+    }
+
+    const std::vector<std::string>& files = book->pgn_files();
+    PyObject* list = PyList_New(Py_ssize_t(moves.size()));
+
+    for (size_t i = 0; i < moves.size(); ++i)
+    {
+        const BookMove& m = moves[i];
+        const uint64_t* r = m.results;
+        PyObject* offsets = PyList_New(Py_ssize_t(m.games.size()));
+        PyObject* lengths = PyList_New(Py_ssize_t(m.games.size()));
+        PyObject* names = PyList_New(Py_ssize_t(m.games.size()));
+
+        for (size_t j = 0; j < m.games.size(); ++j)
+        {
+            const GameEntry& g = m.games[j];
+            PyList_SET_ITEM(offsets, j, PyLong_FromUnsignedLongLong(g.ofs));
+            PyList_SET_ITEM(lengths, j, PyLong_FromUnsignedLong(g.len));
+            PyList_SET_ITEM(names, j, PyUnicode_FromString(
+                g.file < files.size() ? files[g.file].c_str() : ""));
+        }
+
+        PyObject* move = PyDict_New();
+        set_item(move, "move", PyUnicode_FromString(UCI::move(Move(m.move), false).c_str()));
+        set_item(move, "weight", PyLong_FromUnsignedLong(m.weight));
+        set_item(move, "games", PyLong_FromUnsignedLongLong(r[0] + r[1] + r[2] + r[3]));
+        set_item(move, "wins", PyLong_FromUnsignedLongLong(r[0]));
+        set_item(move, "losses", PyLong_FromUnsignedLongLong(r[1]));
+        set_item(move, "draws", PyLong_FromUnsignedLongLong(r[2]));
+        set_item(move, "pgn offsets", offsets);
+
+        // As with 'find', lengths and files only when known and useful
+        if (book->has_games())
+            set_item(move, "pgn lengths", lengths);
+        else
+            Py_DECREF(lengths);
+
+        if (files.size() > 1)
+            set_item(move, "pgn files", names);
+        else
+            Py_DECREF(names);
+
+        PyList_SET_ITEM(list, i, move);
+    }
+
+    PyObject* result = PyDict_New();
+    set_item(result, "fen", PyUnicode_FromString(fenStr.c_str()));
+    set_item(result, "key", PyLong_FromUnsignedLongLong(key));
+    set_item(result, "moves", list);
+    return result;
+}
+
+/// get_games(pgn, offsets, lengths, files=None) reads the games at the given
+/// offsets and lengths, as returned by find(), out of the PGN file, or out of
+/// the PGN file of each game when 'files' is given. Returns a list of strings.
+
+PyObject* get_games(PyObject*, PyObject* args, PyObject* kwargs) {
+
+    const char* kwlist[] = { "pgn", "offsets", "lengths", "files", nullptr };
+    const char* pgn;
+    PyObject *pyOffsets, *pyLengths, *pyFiles = Py_None;
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<std::string> files;
+
+    if (   !PyArg_ParseTupleAndKeywords(args, kwargs, "sOO|O", const_cast<char**>(kwlist), &pgn,
+                                        &pyOffsets, &pyLengths, &pyFiles)
+        || !to_numbers(pyOffsets, offsets)
+        || !to_numbers(pyLengths, lengths)
+        || (pyFiles != Py_None && !to_strings(pyFiles, files)))
+        return nullptr;
+
+    if (lengths.size() != offsets.size() || (!files.empty() && files.size() != offsets.size()))
+    {
+        PyErr_SetString(PyExc_ValueError, "offsets, lengths and files differ in size");
+        return nullptr;
+    }
+
+    files.resize(offsets.size(), pgn);
+    std::vector<std::string> games(offsets.size());
+    std::string missing;
+
+    Py_BEGIN_ALLOW_THREADS
+
+    std::ifstream f;
+    std::string cur;
+
+    for (size_t i = 0; i < games.size() && missing.empty(); ++i)
+    {
+        if (files[i] != cur)
+        {
+            f.close();
+            f.open(files[i], std::ifstream::in | std::ifstream::binary);
+            cur = files[i];
+        }
+
+        std::string& g = games[i];
+        g.resize(lengths[i]);
+        f.seekg(std::streamoff(offsets[i]));
+        f.read(&g[0], std::streamsize(g.size()));
+
+        if (!f)
+            missing = files[i];
+
+        // Line endings as in text mode
+        g.erase(std::remove(g.begin(), g.end(), '\r'), g.end());
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (!missing.empty())
+    {
+        PyErr_SetString(PyExc_IOError, missing.c_str());
+        return nullptr;
+    }
+
+    PyObject* list = PyList_New(Py_ssize_t(games.size()));
+
+    for (size_t i = 0; i < games.size(); ++i)
+        PyList_SET_ITEM(list, i, PyUnicode_DecodeUTF8(games[i].data(),
+                                                      Py_ssize_t(games[i].size()), "replace"));
+    return list;
+}
+
+PyMethodDef Methods[] = {
+    { "make_book", (PyCFunction)(void(*)(void))make_book, METH_VARARGS | METH_KEYWORDS,
+      "Build a book out of PGN files" },
+    { "find", (PyCFunction)(void(*)(void))find, METH_VARARGS | METH_KEYWORDS,
+      "Find the moves and the games of a position" },
+    { "get_games", (PyCFunction)(void(*)(void))get_games, METH_VARARGS | METH_KEYWORDS,
+      "Read games out of the PGN files" },
+    { nullptr, nullptr, 0, nullptr }
+};
+
+PyModuleDef Module = {
+    PyModuleDef_HEAD_INIT, "chess_db_native", "Build and probe chess_db books", -1,
+    Methods, nullptr, nullptr, nullptr, nullptr
+};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit_chess_db_native() {
+
+    Bitboards::init();
+    Position::init();
+    Parser::init();
+    return PyModule_Create(&Module);
+}
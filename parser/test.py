@@ -1,15 +1,25 @@
 #!/usr/bin/env python
 
 import argparse
+import ctypes
 import hashlib
 import glob
 import json
 import os
+import socket
+import struct
 import sys
-from subprocess import STDOUT, check_output as qx
+import time
+from subprocess import DEVNULL, PIPE, STDOUT, Popen, check_output as qx
 from chess_db import Parser
 
+try:
+    import chess_db_native  # Built with 'make python'
+except ImportError:
+    chess_db_native = None
+
 PARSER = './parser.exe' if 'nt' in os.name else './parser'
+LIBCHESSDB = './libchessdb.so'  # Built with 'make lib'
 
 DB = {'GM_games'               : {'games':  20, 'moves':  1519, 'fixed':   0},
       'ambiguous'              : {'games':   4, 'moves':   194, 'fixed':   2},
@@ -49,10 +59,10 @@ FIND_TEST = {
                        "key": 5060803636482931868,
                        "moves": [
                         {
-                            "move": "e2e4", "weight": 49151, "games": 3, "wins": 1, "losses": 2, "draws": 0, "pgn offsets": [0, 5176, 3656]
+                            "move": "e2e4", "weight": 49151, "games": 3, "wins": 1, "losses": 2, "draws": 0, "pgn offsets": [0, 5180, 3664], "pgn lengths": [1688, 3025, 1512]
                         },
                         {
-                            "move": "d2d4", "weight": 16383, "games": 1, "wins": 1, "losses": 0, "draws": 0, "pgn offsets": [1688]
+                            "move": "d2d4", "weight": 16383, "games": 1, "wins": 1, "losses": 0, "draws": 0, "pgn offsets": [1692], "pgn lengths": [1968]
                         }
                         ]
                        }
@@ -66,10 +76,10 @@ FIND_TEST = {
                 "key": 5060803636482931868,
                 "moves": [
                 {
-                    "move": "e2e4", "weight": 36408, "games": 5, "wins": 1, "losses": 4, "draws": 0, "pgn offsets": [0, 2808, 5464, 8304, 16480]
+                    "move": "e2e4", "weight": 36408, "games": 5, "wins": 1, "losses": 4, "draws": 0, "pgn offsets": [0, 2811, 5468, 8312, 16483], "pgn lengths": [1515, 2653, 2840, 3264, 1251]
                 },
                 {
-                    "move": "d2d4", "weight": 29126, "games": 4, "wins": 1, "losses": 3, "draws": 0, "pgn offsets": [14368, 17736, 1512, 11576]
+                    "move": "d2d4", "weight": 29126, "games": 4, "wins": 1, "losses": 3, "draws": 0, "pgn offsets": [14375, 17738, 1519, 11580], "pgn lengths": [2104, 2441, 1288, 2791]
                 }
                 ]
              }
@@ -98,21 +108,427 @@ def run_file(p, file, stats):
     print('OK' if ok1 and ok2 and ok3 else 'FAIL')
 
 
+def sort_games(moves):
+    for m in moves:
+        games = sorted(zip(m['pgn offsets'], m['pgn lengths']))
+        m['pgn offsets'] = [g[0] for g in games]
+        m['pgn lengths'] = [g[1] for g in games]
+
+
 def run_find_test(p, file, test):
     fname = os.path.basename(file)
     fname = os.path.splitext(fname)[0]
     sys.stdout.write('Processing ' + fname + ' for find test...')
-    p.open(file)
+    p.open(os.path.splitext(file)[0] + '.pgn')
     result = p.find(test['input'])
-    for m in result['moves']:
-        m['pgn offsets'].sort()
+    sort_games(result['moves'])
     sorted_output = json.dumps(result, sort_keys=True)
 
     expected_output = test['output']
-    for m in expected_output['moves']:
-        m['pgn offsets'].sort()
+    sort_games(expected_output['moves'])
     expected_result = json.dumps(expected_output, sort_keys=True)
-    print('OK' if sorted_output == expected_result else 'FAIL')
+    ok = sorted_output == expected_result
+    for m in result['moves']:
+        games = p.get_games(m['pgn offsets'], m['pgn lengths'])
+        ok = ok and all(g.startswith('[Event ') for g in games)
+    print('OK' if ok else 'FAIL')
+
+
+def run_threads_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with threads...')
+    sys.stdout.flush()
+    digests = []
+    for threads in (1, 4):
+        qx([path, 'book', file, 'full', 'threads', str(threads)], stderr=STDOUT)
+        with open(os.path.splitext(file)[0] + '.bin', 'rb') as f:
+            digests.append(hashlib.md5(f.read()).hexdigest())
+    print('OK' if digests[0] == digests[1] else 'FAIL')
+
+
+def run_stream_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' from stdin...')
+    sys.stdout.flush()
+    book = os.path.splitext(file)[0] + '.bin'
+    stream_book = os.path.splitext(file)[0] + '_stream.bin'
+    qx([path, 'book', file, 'full'], stderr=STDOUT)
+    with open(file, 'rb') as f:
+        qx([path, 'book', '-', 'full', 'out', stream_book], stdin=f, stderr=STDOUT)
+    with open(book, 'rb') as f1, open(stream_book, 'rb') as f2:
+        ok = f1.read() == f2.read()
+    for ext in ('', '.games'):
+        os.remove(stream_book + ext)
+    print('OK' if ok else 'FAIL')
+
+
+def run_summary_test(p, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with summary...')
+    sys.stdout.flush()
+    fen = FIND_TEST['hayes.bin']['input']
+    p.open(file)
+    results = []
+    for summary in (False, True, False):
+        p.make(True, summary)
+        results.append([p.find(fen, limit, skip) for limit, skip in ((10, 0), (3, 2))])
+    ok = results[0] == results[1] == results[2] and not os.path.isfile(p.db + '.sum')
+    print('OK' if ok else 'FAIL')
+
+
+def run_variations_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with variations...')
+    sys.stdout.flush()
+    digests = []
+    for threads in (1, 4):
+        out = qx([path, 'book', file, 'full', 'variations', 'threads', str(threads)],
+                 stderr=DEVNULL)
+        result = json.loads(out.decode('utf-8'))
+        with open(os.path.splitext(file)[0] + '.bin', 'rb') as f:
+            digests.append(hashlib.md5(f.read()).hexdigest())
+    ok = (result['Games'] == DB[fname]['games'] and result['Moves'] == DB[fname]['moves']
+          and result['Variation moves'] > 0 and digests[0] == digests[1])
+    print('OK' if ok else 'FAIL')
+
+
+def run_first_rank_test(path, dir):
+    sys.stdout.write('Processing pawn moves to the first rank...')
+    sys.stdout.flush()
+    pgn = (b'[Event "t"]\n\n1. Nf3 Nf6 2. g1 Nc6 *\n\n'
+           b'[Event "t"]\n\n1. e4 e5 2. Nf3 b8 *\n')
+    book = dir + 'first_rank.bin'
+    p = Popen([path, 'book', '-', 'full', 'out', book], stdin=PIPE, stdout=PIPE,
+              stderr=DEVNULL)
+    out = p.communicate(pgn)[0]
+    result = json.loads(out.decode('utf-8'))
+    for ext in ('', '.games'):
+        os.remove(book + ext)
+    ok = (p.returncode == 0 and result['Games'] == 2 and result['Moves'] == 8
+          and result['Incorrect moves'] == 2)
+    print('OK' if ok else 'FAIL')
+
+
+def run_strict_test(path, dir):
+    sys.stdout.write('Processing a rejected game in strict mode...')
+    sys.stdout.flush()
+    games = [b'[Event "t"]\n\n1. e4 e5 1-0\n',
+             b'[Event "t"]\n\n1. d4 Ke5 0-1\n',
+             b'[Event "t"]\n\n1. c4 c5 1/2-1/2\n']
+    pgn = dir + 'strict.pgn'
+    with open(pgn, 'wb') as f:
+        f.write(b'\n'.join(games))
+    result = json.loads(qx([path, 'book', pgn, 'full', 'strict'], stderr=DEVNULL))
+    ok = (result['Games'] == 2 and result['Moves'] == 4
+          and result['Rejected games'] == 1)
+    book = dir + 'strict.bin'
+    moves = json.loads(qx([path, 'find', book, FIND_TEST['hayes.bin']['input']]))['moves']
+    ofs = {m['move']: m['pgn offsets'] for m in moves}
+    ok = ok and ofs == {'e2e4': [0], 'c2c4': [len(games[0]) + len(games[1]) + 2]}
+    for ext in ('.pgn', '.bin', '.bin.games'):
+        os.remove(dir + 'strict' + ext)
+    print('OK' if ok else 'FAIL')
+
+
+def run_malformed_test(path, dir):
+    sys.stdout.write('Processing a malformed PGN...')
+    sys.stdout.flush()
+    pgn = dir + 'malformed.pgn'
+    with open(pgn, 'wb') as f:
+        f.write(b'[Event "t"]\n\n1. e4 e5 . 2. Nf3 *\n')
+    p = Popen([path, 'book', pgn, 'full'], stdout=PIPE, stderr=PIPE)
+    err = p.communicate()[1]
+    ok = p.returncode != 0 and b'Wrong NEXT_MOVE' in err
+    if chess_db_native:
+        try:
+            chess_db_native.make_book(pgn)
+            ok = False
+        except RuntimeError as e:
+            ok = ok and 'Wrong NEXT_MOVE' in str(e)
+    for ext in ('.pgn', '.bin', '.bin.games'):
+        if os.path.isfile(dir + 'malformed' + ext):
+            os.remove(dir + 'malformed' + ext)
+    print('OK' if ok else 'FAIL')
+
+
+def run_update_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with update...')
+    sys.stdout.flush()
+    grow = os.path.splitext(file)[0] + '_grow.pgn'
+    book = os.path.splitext(grow)[0] + '.bin'
+    with open(file, 'rb') as f:
+        data = f.read()
+    cut = data.find(b'[Event ', len(data) // 2)
+    with open(grow, 'wb') as f:
+        f.write(data[:cut])
+    qx([path, 'book', grow, 'full'], stderr=STDOUT)
+    # A failed update leaves the book and its game table as they were
+    old = []
+    for ext in ('', '.games'):
+        with open(book + ext, 'rb') as f:
+            old.append(f.read())
+    with open(grow, 'ab') as f:
+        f.write(b'[Event "t"]\n\n1. e4 e5 . 2. Nf3 *\n')
+    failed = Popen([path, 'update', grow], stdout=DEVNULL, stderr=DEVNULL).wait() != 0
+    for ext in ('', '.games'):
+        with open(book + ext, 'rb') as f:
+            failed = failed and f.read() == old.pop(0)
+        failed = failed and not os.path.exists(book + ext + '.tmp')
+    with open(grow, 'wb') as f:
+        f.write(data)
+    updated = json.loads(qx([path, 'update', grow], stderr=DEVNULL))
+    books = []
+    for ext in ('', '.games'):
+        with open(book + ext, 'rb') as f:
+            books.append(f.read())
+    built = json.loads(qx([path, 'book', grow, 'full'], stderr=DEVNULL))
+    for ext in ('', '.games'):
+        with open(book + ext, 'rb') as f:
+            books.append(f.read())
+        os.remove(book + ext)
+    os.remove(grow)
+    unique = 'Unique positions (%)'
+    ok = failed and books[:2] == books[2:] and updated[unique] == built[unique]
+    print('OK' if ok else 'FAIL')
+
+
+def run_files_test(path, files):
+    sys.stdout.write('Processing ' + str(len(files)) + ' files in one book...')
+    sys.stdout.flush()
+    book = os.path.splitext(files[0])[0] + '_files.bin'
+    fen = FIND_TEST['hayes.bin']['input']
+    qx([path, 'book'] + files + ['full', 'threads', '2', 'out', book], stderr=STDOUT)
+    result = json.loads(qx([path, 'find', book, 'limit', '1000', fen]))
+    names = set()
+    ok = True
+    for m in result['moves']:
+        for ofs, length, name in zip(m['pgn offsets'], m['pgn lengths'], m['pgn files']):
+            with open(name, 'rb') as f:
+                f.seek(ofs)
+                ok = ok and f.read(length).startswith(b'[Event ')
+            names.add(name)
+    for ext in ('', '.games'):
+        os.remove(book + ext)
+    print('OK' if ok and names == set(files) else 'FAIL')
+
+
+def run_find_many_test(p, path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with find many...')
+    sys.stdout.flush()
+    fens = [FIND_TEST['hayes.bin']['input'],
+            'rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1',
+            'rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2']
+    p.open(file)
+    results = p.find_many(fens, 5, 1)
+    ok = len(results) == len(fens)
+    for fen, result in zip(fens, results):
+        expected = json.loads(qx([path, 'find', p.db, 'limit', '5', 'skip', '1', fen]))
+        ok = ok and result == expected
+    missing = json.loads(qx([path, 'find', p.db + '.missing', 'id', '7', fens[0]]))
+    ok = ok and missing == {'id': '7', 'error': 'Could not open book'}
+    print('OK' if ok else 'FAIL')
+
+
+def run_findbatch_test(p, path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with findbatch...')
+    sys.stdout.flush()
+    fens = ['rnbqkbnr/pppp1ppp/8/4p3/4P3/8/PPPP1PPP/RNBQKBNR w KQkq - 0 2',
+            FIND_TEST['hayes.bin']['input'],
+            'rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1']
+    p.open(file)
+    expected = [json.loads(qx([path, 'find', p.db, 'limit', '5', 'skip', '1', fen]))
+                for fen in fens]
+    items = fens + [str(expected[1]['key']), hex(expected[0]['key']), 'not a key']
+    results = json.loads(qx([path, 'findbatch', p.db, 'limit', '5', 'skip', '1',
+                             '; '.join(items)]))
+    keyed = [dict(expected[1]), dict(expected[0])]
+    for r in keyed:
+        del r['fen']
+    ok = results == expected + keyed + [{'error': 'Invalid FEN string or key'}]
+    # Many groups of searches, with keys in the book and not, the same alone
+    with open(p.db, 'rb') as f:
+        book = f.read()
+    keys = sorted(set(struct.unpack('>Q', book[i:i + 8])[0] for i in range(0, len(book), 16 * 97)))
+    keys = [k + d for k in keys[:40] for d in (-1, 0, 1)]
+    results = json.loads(qx([path, 'findbatch', p.db, '; '.join(map(str, keys))]))
+    for k, r in zip(keys, results):
+        ok = ok and [r] == json.loads(qx([path, 'findbatch', p.db, str(k)]))
+    missing = Popen([path, 'findbatch', p.db + '.missing', fens[0]], stdout=PIPE, stderr=PIPE)
+    out, err = missing.communicate()
+    ok = ok and not out and b'Could not open book' in err
+    print('OK' if ok else 'FAIL')
+
+
+def run_native_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with native module...')
+    sys.stdout.flush()
+    fen = FIND_TEST['hayes.bin']['input']
+    book = chess_db_native.make_book(file, threads=2)['book']
+    result = chess_db_native.find(book, fen, limit=5, skip=1)
+    ok = result == json.loads(qx([path, 'find', book, 'limit', '5', 'skip', '1', fen]))
+    for m in result['moves']:
+        games = chess_db_native.get_games(file, m['pgn offsets'], m['pgn lengths'])
+        ok = ok and all(g.startswith('[Event ') for g in games)
+    # A book rebuilt by another process is mapped again
+    other = os.path.join(os.path.dirname(file), 'hayes.pgn')
+    qx([path, 'book', other, 'full', 'out', book], stderr=STDOUT)
+    result = chess_db_native.find(book, fen, limit=5, skip=1)
+    ok = ok and result == json.loads(qx([path, 'find', book, 'limit', '5', 'skip', '1', fen]))
+    qx([path, 'book', file, 'full'], stderr=STDOUT)
+    print('OK' if ok else 'FAIL')
+
+
+class CGame(ctypes.Structure):
+    _fields_ = [('offset', ctypes.c_uint64), ('length', ctypes.c_uint32),
+                ('file', ctypes.c_uint32)]
+
+
+class CMove(ctypes.Structure):
+    _fields_ = [('move', ctypes.c_char * 6), ('weight', ctypes.c_uint16),
+                ('games', ctypes.c_uint64), ('wins', ctypes.c_uint64),
+                ('losses', ctypes.c_uint64), ('draws', ctypes.c_uint64),
+                ('num_games', ctypes.c_size_t), ('game', ctypes.POINTER(CGame))]
+
+
+class COptions(ctypes.Structure):
+    _fields_ = [(f, ctypes.c_int) for f in ('full', 'summary', 'strict', 'variations', 'update')] + \
+               [(f, ctypes.c_size_t) for f in ('threads', 'memory_mb', 'cache_mb')]
+
+
+def run_lib_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' with libchessdb...')
+    sys.stdout.flush()
+    lib = ctypes.CDLL(os.path.abspath(LIBCHESSDB))
+    lib.chessdb_open.restype = ctypes.c_void_p
+    lib.chessdb_probe_fen.restype = ctypes.c_void_p
+    lib.chessdb_probe_fen.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t]
+    lib.chessdb_num_moves.restype = ctypes.c_size_t
+    lib.chessdb_num_moves.argtypes = [ctypes.c_void_p]
+    lib.chessdb_move_at.restype = ctypes.POINTER(CMove)
+    lib.chessdb_move_at.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+    lib.chessdb_free_moves.argtypes = [ctypes.c_void_p]
+    lib.chessdb_close.argtypes = [ctypes.c_void_p]
+    progress = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_uint64, ctypes.c_uint64)
+    book = os.path.splitext(file)[0] + '.bin'
+    lib_book = os.path.splitext(file)[0] + '_lib.bin'
+    with open(file, 'rb') as f:
+        data = f.read()
+    done = []
+    report = progress(lambda ctx, n, total: done.append((n, total)))
+    options = COptions(full=1, threads=2)
+    ok = lib.chessdb_build_buffer(data, ctypes.c_size_t(len(data)), lib_book.encode(),
+                                  ctypes.byref(options), report, None, None) == 0
+    ok = ok and done[-1] == (len(data), len(data))
+    qx([path, 'book', file, 'full'], stderr=STDOUT)
+    with open(book, 'rb') as f1, open(lib_book, 'rb') as f2:
+        ok = ok and f1.read() == f2.read()
+    fen = FIND_TEST['hayes.bin']['input']
+    expected = json.loads(qx([path, 'find', book, 'limit', '5', fen]))['moves']
+    handle = lib.chessdb_open(lib_book.encode())
+    moves = lib.chessdb_probe_fen(handle, fen.encode(), 5, 0)
+    ok = ok and lib.chessdb_num_moves(moves) == len(expected)
+    for i, e in enumerate(expected):
+        m = lib.chessdb_move_at(moves, i).contents
+        games = [m.game[j] for j in range(m.num_games)]
+        ok = ok and (m.move.decode(), m.weight, m.games, m.wins) == \
+            (e['move'], e['weight'], e['games'], e['wins'])
+        ok = ok and [g.offset for g in games] == e['pgn offsets']
+        ok = ok and [g.length for g in games] == e['pgn lengths']
+    lib.chessdb_free_moves(moves)
+    ok = ok and not lib.chessdb_probe_fen(handle, fen.encode(), 0, 0)
+    ok = ok and not lib.chessdb_probe_fen(handle, fen.encode(), 1 << 62, 0)
+    lib.chessdb_close(handle)
+    bad = b'[Event "t"]\n\n1. e4 e5 . 2. Nf3 *\n'
+    lib.chessdb_last_error.restype = ctypes.c_char_p
+    ok = ok and lib.chessdb_build_buffer(bad, ctypes.c_size_t(len(bad)), lib_book.encode(),
+                                         None, None, None, None) == -1
+    ok = ok and b'Wrong NEXT_MOVE' in lib.chessdb_last_error()
+    for ext in ('', '.games'):
+        if os.path.isfile(lib_book + ext):
+            os.remove(lib_book + ext)
+    print('OK' if ok else 'FAIL')
+
+
+def run_serve_test(path, file):
+    fname = os.path.basename(file)
+    fname = os.path.splitext(fname)[0]
+    sys.stdout.write('Processing ' + fname + ' from server...')
+    sys.stdout.flush()
+    book = os.path.splitext(file)[0] + '.bin'
+    sock = os.path.splitext(file)[0] + '.sock'
+    qx([path, 'book', file, 'full'], stderr=STDOUT)
+    server = Popen([path, 'serve', sock, book, 'threads', '2'], stderr=DEVNULL)
+    fens = [FIND_TEST['hayes.bin']['input'],
+            'rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1']
+    s = socket.socket(socket.AF_UNIX)
+    while True:  # Until the server is listening
+        try:
+            s.connect(sock)
+            break
+        except OSError:
+            time.sleep(0.01)
+    # More persistent clients than threads, served at once
+    clients = [s] + [socket.socket(socket.AF_UNIX) for _ in range(3)]
+    for c in clients[1:]:
+        c.connect(sock)
+    for c in clients:
+        c.settimeout(5)
+    ok = True
+    for c in reversed(clients):
+        c.sendall(''.join(json.dumps({'fen': fen, 'limit': 5}) + '\n' for fen in fens).encode())
+        f = c.makefile()
+        for fen in fens:
+            expected = json.loads(qx([path, 'find', book, 'limit', '5', fen]))
+            ok = ok and json.loads(f.readline()) == expected
+    # A client that sends many requests without reading the responses does
+    # not hold up the others, and gets its responses when it reads them
+    greedy = socket.socket(socket.AF_UNIX)
+    greedy.connect(sock)
+    greedy.setblocking(False)
+    try:
+        for _ in range(20000):
+            greedy.send((json.dumps({'fen': fens[0], 'limit': 5}) + '\n').encode())
+    except BlockingIOError:
+        pass
+    expected = json.loads(qx([path, 'find', book, 'limit', '5', fens[0]]))
+    for c in clients:
+        try:
+            c.sendall((json.dumps({'fen': fens[0], 'limit': 5}) + '\n').encode())
+            ok = ok and json.loads(c.makefile().readline()) == expected
+        except socket.timeout:
+            ok = False
+    greedy.settimeout(5)
+    ok = ok and json.loads(greedy.makefile().readline()) == expected
+    greedy.close()
+    # A request without newline is cut once too long
+    try:
+        clients[0].sendall(b'x' * 100000)
+        while clients[0].recv(4096):
+            pass
+    except socket.timeout:
+        ok = False
+    except OSError:  # Reset by the server
+        pass
+    for c in clients:
+        c.close()
+    server.kill()
+    server.wait()
+    os.remove(sock)
+    print('OK' if ok else 'FAIL')
 
 
 if __name__ == "__main__":
@@ -138,6 +554,24 @@ if __name__ == "__main__":
     for fname, item in FIND_TEST.items():
         run_find_test(p, args.dir + fname, item)
 
+    run_threads_test(args.path, args.dir + 'famous_games.pgn')
+    run_stream_test(args.path, args.dir + 'famous_games.pgn')
+    run_summary_test(p, args.dir + 'famous_games.pgn')
+    run_variations_test(args.path, args.dir + 'd00_chess_informant.pgn')
+    run_update_test(args.path, args.dir + 'famous_games.pgn')
+    run_first_rank_test(args.path, args.dir)
+    run_strict_test(args.path, args.dir)
+    run_malformed_test(args.path, args.dir)
+    run_files_test(args.path, [args.dir + 'hayes.pgn', args.dir + 'polgar.pgn'])
+    run_find_many_test(p, args.path, args.dir + 'famous_games.pgn')
+    run_findbatch_test(p, args.path, args.dir + 'famous_games.pgn')
+    if chess_db_native:
+        run_native_test(args.path, args.dir + 'famous_games.pgn')
+    if os.path.isfile(LIBCHESSDB):
+        run_lib_test(args.path, args.dir + 'famous_games.pgn')
+    if hasattr(socket, 'AF_UNIX'):
+        run_serve_test(args.path, args.dir + 'famous_games.pgn')
+
     print("\ngames {}, moves {}, fixed {}\n"
           .format(stats['games'], stats['moves'], stats['fixed']))
 
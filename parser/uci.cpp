@@ -30,7 +30,11 @@ using namespace std;
 
 namespace Parser {
     void make_book(istringstream& is);
+    void update_book(istringstream& is);
     void find(istringstream& is);
+    void findbatch(istringstream& is);
+    void serve(istringstream& is);
+    void bench(istringstream& is);
 }
 
 namespace {
@@ -110,7 +114,11 @@ void UCI::loop(int argc, char* argv[]) {
       else if (token == "position") position(pos, is);
       else if (token == "d")        std::cerr << pos << std::endl;
       else if (token == "book")     Parser::make_book(is);
+      else if (token == "update")   Parser::update_book(is);
       else if (token == "find")     Parser::find(is);
+      else if (token == "findbatch") Parser::findbatch(is);
+      else if (token == "serve")    Parser::serve(is);
+      else if (token == "bench")    Parser::bench(is);
       else if (token == "isready")  std::cout << "readyok" << std::endl;
       else
           std::cerr << "Unknown command: " << cmd << std::endl;